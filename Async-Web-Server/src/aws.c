@@ -1,9 +1,15 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -23,392 +29,2443 @@
 #include "utils/sock_util.h"
 #include "utils/w_epoll.h"
 
-/* server socket file descriptor */
-static int listenfd;
+/* event loops, one per thread */
+static struct worker workers[AWS_MAX_WORKERS];
+static int num_workers = AWS_DEFAULT_WORKERS;
+
+/* I/O engine driving the event loops, picked with -e */
+static int use_uring;
+
+/* dynamic files go through splice(2) instead of AIO buffers, set with -d */
+static int use_splice;
+
+/* largest file served from an in-memory response, set with -c */
+static size_t response_cache_max = FILE_CACHE_RESPONSE_MAX;
+
+/* the demo handlers below /stream/ are served, set with -g */
+static int use_demo_handlers;
+
+/* start of the server, for the uptime reported with the statistics */
+static uint64_t start_time_us;
+
+static int connection_append_filename(struct connection *conn, const char *buf, size_t len)
+{
+	/* Grow the file name, moving it off the inline buffer when needed. */
+	char *name;
+
+	if (conn->filename_len + len >= AWS_NAME_MAX)
+		return -1;
+
+	if (conn->filename_len + len >= conn->filename_size) {
+		name = pool_get(&conn->worker->name_pool);
+		if (name == NULL)
+			return -1;
+		memcpy(name, conn->filename, conn->filename_len);
+		conn->filename = name;
+		conn->filename_size = AWS_NAME_MAX;
+	}
+
+	memcpy(conn->filename + conn->filename_len, buf, len);
+	conn->filename_len += len;
+	conn->filename[conn->filename_len] = '\0';
 
-/* epoll file descriptor for multiplexing */
-static int epollfd;
+	return 0;
+}
 
-static io_context_t ctx;
+static void connection_reset_filename(struct connection *conn)
+{
+	if (conn->filename != conn->filename_inline)
+		pool_put(&conn->worker->name_pool, conn->filename);
+	conn->filename = conn->filename_inline;
+	conn->filename_size = sizeof(conn->filename_inline);
+	conn->filename_len = 0;
+	conn->filename[0] = '\0';
+	conn->dot_dot = 0;
+}
 
-static int aws_on_path_cb(http_parser *p, const char *buf, size_t len)
+static int connection_build_filename(struct connection *conn)
 {
 	/*
-	 * Callback function for parsing HTTP requests.
-	 * Records the requested path in the connection structure.
+	 * Name the requested file below the document root, which takes the
+	 * place of the leading slash of the request path.
 	 */
-	struct connection *conn = (struct connection *)p->data;
+	const char *path = conn->recv_buffer + conn->request_spans.path.off;
+	size_t len = conn->request_spans.path.len;
+
+	if (len == 0)
+		return -1;
+	if (path[0] == '/') {
+		path++;
+		len--;
+	}
 
-	memcpy(conn->request_path, buf, len);
-	conn->request_path[len] = '\0';
-	conn->have_path = 1;
+	if (connection_append_filename(conn, AWS_DOCUMENT_ROOT,
+				       sizeof(AWS_DOCUMENT_ROOT) - 1) < 0 ||
+	    connection_append_filename(conn, path, len) < 0)
+		return -1;
+	conn->dot_dot = memmem(conn->filename, conn->filename_len, "..", 2) != NULL;
 
 	return 0;
 }
 
-static void connection_prepare_send_404(struct connection *conn)
-{
-	/* Prepare the connection buffer to send the 404 header. */
-	snprintf(conn->send_buffer, sizeof(conn->send_buffer),
-		"HTTP/1.1 404 Not Found\r\n"
-		"Content-Length: 0\r\n"
-		"Connection: close\r\n"
-		"\r\n");
+/* constant text of known length, matched against requests or put in replies */
+struct header_line {
+	const char *text;
+	size_t len;
+};
 
-	conn->send_len = strlen(conn->send_buffer);
+#define HEADER_LINE(text)	{ text, sizeof(text) - 1 }
+
+/* names of the headers kept, indexed by enum request_header */
+static const struct header_line request_header_names[REQUEST_HEADER_COUNT] = {
+	[REQUEST_HEADER_RANGE] = HEADER_LINE("Range"),
+	[REQUEST_HEADER_IF_NONE_MATCH] = HEADER_LINE("If-None-Match"),
+	[REQUEST_HEADER_IF_MODIFIED_SINCE] = HEADER_LINE("If-Modified-Since"),
+	[REQUEST_HEADER_ACCEPT_ENCODING] = HEADER_LINE("Accept-Encoding"),
+};
+
+static void connection_find_headers(struct connection *conn)
+{
+	/* Keep the values of the headers the server acts on; the last wins. */
+	const http_parser_header *h;
+	const char *name;
+	unsigned int i;
+	int j;
+
+	for (i = 0; i < conn->request_spans.num_headers; i++) {
+		h = &conn->request_headers[i];
+		name = conn->recv_buffer + h->name.off;
+		for (j = 0; j < REQUEST_HEADER_COUNT; j++) {
+			if (h->name.len == request_header_names[j].len &&
+			    strncasecmp(name, request_header_names[j].text, h->name.len) == 0) {
+				conn->headers[j].off = h->value.off;
+				conn->headers[j].len = h->value.len;
+				break;
+			}
+		}
+	}
 }
 
-static enum resource_type connection_get_resource_type(struct connection *conn)
+static int aws_on_headers_complete_cb(http_parser *p)
 {
-	const char *static_keyword = "static";
-	const char *dynamic_keyword = "dynamic";
+	/* Request line and headers are in: settle what is to be served. */
+	struct connection *conn = (struct connection *)p->data;
 
-	if (strstr(conn->filename, static_keyword) != NULL)
-		return RESOURCE_TYPE_STATIC;
-	else if (strstr(conn->filename, dynamic_keyword) != NULL)
-		return RESOURCE_TYPE_DYNAMIC;
-	else
-		return RESOURCE_TYPE_DYNAMIC;
+	if (connection_build_filename(conn) < 0)
+		return -1;
+	connection_find_headers(conn);
+
+	conn->keep_alive = http_should_keep_alive(p);
+
+	return 0;
 }
 
-struct connection *connection_create(int sockfd)
+static int aws_on_message_complete_cb(http_parser *p)
 {
-	/* Initialize connection structure on given socket. */
-	struct connection *conn = malloc(sizeof(*conn));
+	/*
+	 * Stop the parser at the end of the request so that pipelined requests
+	 * are left in the receive buffer until this one has been answered.
+	 */
+	struct connection *conn = (struct connection *)p->data;
 
-	conn->sockfd = sockfd;
-	memset(conn->recv_buffer, 0, BUFSIZ);
-	memset(conn->send_buffer, 0, BUFSIZ);
-	conn->state = STATE_INITIAL;
-	conn->ctx = 0;
+	connection_set_state(conn, STATE_REQUEST_RECEIVED);
 
-	io_setup(1, &conn->ctx);
+	return 1;
+}
 
-	return conn;
+static const http_parser_settings aws_parser_settings = {
+	.on_message_begin = 0,
+	.on_header_field = 0,
+	.on_header_value = 0,
+	.on_path = 0,
+	.on_url = 0,
+	.on_fragment = 0,
+	.on_query_string = 0,
+	.on_body = 0,
+	.on_headers_complete = aws_on_headers_complete_cb,
+	.on_message_complete = aws_on_message_complete_cb
+};
+
+static const struct header_line *connection_header_line(struct connection *conn)
+{
+	/* The Connection header, with the blank line ending the headers. */
+	static const struct header_line lines[2] = {
+		HEADER_LINE("Connection: close\r\n\r\n"),
+		HEADER_LINE("Connection: keep-alive\r\n\r\n"),
+	};
+
+	return &lines[conn->keep_alive != 0];
 }
 
-void connection_start_async_io(struct connection *conn)
+static const struct header_line *connection_encoding_lines(struct connection *conn)
 {
-	/* Open the file for reading */
-	 conn->fd = open(conn->filename, O_RDONLY);
+	/* Content-Encoding of a precompressed variant, and Vary if needed. */
+	static const struct header_line lines[FILE_ENCODING_COUNT] = {
+		[FILE_ENCODING_GZIP] = HEADER_LINE("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"),
+		[FILE_ENCODING_ZSTD] = HEADER_LINE("Content-Encoding: zstd\r\nVary: Accept-Encoding\r\n"),
+	};
+	static const struct header_line vary = HEADER_LINE("Vary: Accept-Encoding\r\n");
+	static const struct header_line none = HEADER_LINE("");
 
-	if (conn->fd == -1) {
-		perror("Error opening file");
-		connection_prepare_send_404(conn);
-		return;
-	}
+	if (conn->encoding >= 0)
+		return &lines[conn->encoding];
 
-	/* Prepare iocb for the asynchronous read operation */
-	memset(conn->recv_buffer, 0, BUFSIZ);
-	io_prep_pread(&conn->iocb, conn->fd, conn->recv_buffer, BUFSIZ, conn->file_pos);
-	conn->piocb[0] = &conn->iocb;
+	return conn->vary ? &vary : &none;
+}
 
-	/* Submit the asynchronous read operation */
-	io_submit(conn->ctx, 1, conn->piocb);
+/*
+ * Reply headers are put together in send_buffer from pieces whose length is
+ * known, and numbers, instead of being formatted: no format string is
+ * interpreted and no piece is measured again. The headers are bounded well
+ * below the size of the buffer; anything past it would be cut off.
+ */
 
-	/* Set the connection state to indicate ongoing asynchronous operation */
-	conn->state = STATE_ASYNC_ONGOING;
+static void reply_start(struct connection *conn)
+{
+	conn->send_len = 0;
+	conn->send_pos = 0;
 }
 
-void connection_remove(struct connection *conn)
+static void reply_put(struct connection *conn, const char *text, size_t len)
 {
-	/* Remove connection handler. */
-	if (conn->state == STATE_INITIAL) {
-		close(conn->sockfd);
-		conn->state = STATE_CONNECTION_CLOSED;
-		free(conn);
-	}
+	size_t room = sizeof(conn->send_buffer) - conn->send_len;
+
+	if (len > room)
+		len = room;
+	memcpy(conn->send_buffer + conn->send_len, text, len);
+	conn->send_len += len;
 }
 
-void handle_new_connection(void)
+#define reply_put_literal(conn, text)	reply_put(conn, text, sizeof(text) - 1)
+
+static void reply_put_line(struct connection *conn, const struct header_line *line)
 {
-	static int sockfd;
-	socklen_t addrlen = sizeof(struct sockaddr_in);
-	struct sockaddr_in addr;
-	struct connection *conn;
-	int rc;
+	reply_put(conn, line->text, line->len);
+}
+
+static void reply_put_number(struct connection *conn, unsigned long value)
+{
+	char digits[24];
+	char *p = digits + sizeof(digits);
 
-	/* Accept new connection. */
-	sockfd = accept(listenfd, (SSA *)&addr, &addrlen);
+	do {
+		*--p = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
 
-	dlog(LOG_ERR, "Accepted connection from: %s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+	reply_put(conn, p, digits + sizeof(digits) - p);
+}
 
-	/* Set socket to be non-blocking. */
-	int flags = fcntl(sockfd, F_GETFL, 0);
+static void reply_put_validators(struct connection *conn)
+{
+	reply_put(conn, conn->file->validators, conn->file->validators_len);
+	reply_put_line(conn, connection_encoding_lines(conn));
+}
 
-	flags = flags | O_NONBLOCK;
-	fcntl(sockfd, F_SETFL, flags);
+static void connection_prepare_send_reply_header(struct connection *conn)
+{
+	/* Prepare the connection buffer to send the reply header. */
+	STATS_INC(conn->worker->stats.responses[RESPONSE_200]);
+	reply_start(conn);
+	reply_put_literal(conn, "HTTP/1.1 200 OK\r\nContent-Length: ");
+	reply_put_number(conn, conn->file_size);
+	reply_put_literal(conn, "\r\nAccept-Ranges: bytes\r\n");
+	reply_put_validators(conn);
+	reply_put_line(conn, connection_header_line(conn));
+}
 
-	/* Instantiate new connection handler. */
-	conn = connection_create(sockfd);
+/* text around the numbers of a multipart/byteranges part header */
+#define PART_HEADER_START						\
+	"--" AWS_RANGE_BOUNDARY "\r\n"					\
+	"Content-Type: application/octet-stream\r\n"			\
+	"Content-Range: bytes "
+#define PART_CLOSE		"\r\n--" AWS_RANGE_BOUNDARY "--\r\n"
 
-	/* Add socket to epoll. */
-	rc = w_epoll_add_ptr_in(epollfd, sockfd, conn);
+static size_t decimal_len(unsigned long value)
+{
+	size_t len = 1;
 
-	/* Initialize HTTP_REQUEST parser. */
-	http_parser_init(&conn->request_parser, HTTP_REQUEST);
-	conn->request_parser.data = conn;
+	while (value >= 10) {
+		value /= 10;
+		len++;
+	}
+
+	return len;
 }
 
-int parse_header(struct connection *conn)
+static size_t connection_part_header_len(struct connection *conn, unsigned int index)
 {
-	/* Parse the HTTP header and extract the file path. */
-	/* Use mostly null settings except for on_path callback. */
-	http_parser_settings settings_on_path = {
-		.on_message_begin = 0,
-		.on_header_field = 0,
-		.on_header_value = 0,
-		.on_path = aws_on_path_cb,
-		.on_url = 0,
-		.on_fragment = 0,
-		.on_query_string = 0,
-		.on_body = 0,
-		.on_headers_complete = 0,
-		.on_message_complete = 0
-	};
-	return 0;
+	/* Length of what connection_put_part_header() puts for index. */
+	struct byte_range *r = &conn->ranges[index];
+
+	if (index == conn->range_count)
+		return sizeof(PART_CLOSE) - 1;
+
+	return (index > 0 ? 2 : 0) + sizeof(PART_HEADER_START) - 1 +
+		decimal_len(r->start) + 1 + decimal_len(r->end) + 1 +
+		decimal_len(conn->file_size) + 4;
 }
 
-enum connection_state connection_send_static(struct connection *conn)
+static void connection_put_part_header(struct connection *conn, unsigned int index)
 {
-	/* Send static data using sendfile(2). */
-	conn->fd = open(conn->filename, O_RDONLY);
-	off_t offset = 0;
-	ssize_t sent_bytes = 0;
+	/*
+	 * Put the boundary line and headers opening part index of a
+	 * multipart/byteranges body, or the closing boundary after the last
+	 * part.
+	 */
+	struct byte_range *r = &conn->ranges[index];
 
-	while ((sent_bytes = sendfile(conn->sockfd, conn->fd, &offset, BUFSIZ)) > 0) {
-		if (sent_bytes == -1) {
-			dlog(LOG_INFO, "Error in sendfile: %s\n", strerror(errno));
-			break;
-		}
+	if (index == conn->range_count) {
+		reply_put_literal(conn, PART_CLOSE);
+		return;
 	}
 
-	if (sent_bytes == -1)
-		dlog(LOG_INFO, "Error in sendfile: %s\n", strerror(errno));
-	close(conn->fd);
-	return STATE_NO_STATE;
+	if (index > 0)
+		reply_put_literal(conn, "\r\n");
+	reply_put_literal(conn, PART_HEADER_START);
+	reply_put_number(conn, r->start);
+	reply_put_literal(conn, "-");
+	reply_put_number(conn, r->end);
+	reply_put_literal(conn, "/");
+	reply_put_number(conn, conn->file_size);
+	reply_put_literal(conn, "\r\n\r\n");
 }
 
-int connection_send_data(struct connection *conn)
+static void connection_select_range(struct connection *conn)
 {
-	/* May be used as a helper function. */
-	/* Send as much data as possible from the connection send buffer.
-	 * Returns the number of bytes sent or -1 if an error occurred
+	/*
+	 * Point the transfer at the current range. Reads of the previous one
+	 * have all been sent, so the ring of buffers starts over empty.
 	 */
-	return -1;
+	if (conn->range_index < conn->range_count) {
+		conn->file_pos = conn->ranges[conn->range_index].start;
+		conn->file_end = conn->ranges[conn->range_index].end + 1;
+	} else {
+		conn->file_pos = conn->file_end;
+	}
+	conn->aio_offset = conn->file_pos;
+	conn->aio_head = 0;
+	conn->aio_tail = 0;
+	conn->aio_used = 0;
 }
 
-int connection_send_dynamic(struct connection *conn)
+static void connection_prepare_send_partial(struct connection *conn)
 {
-	ssize_t sent_bytes = 0;
-	off_t total_file_size = conn->file_size;
+	/*
+	 * Prepare the 206 reply header. Several ranges make a multipart body,
+	 * whose exact length is known up front; the header of the first part
+	 * goes out along with the reply header.
+	 */
+	struct byte_range *r = conn->ranges;
+	size_t len = 0;
+	unsigned int i;
+
+	STATS_INC(conn->worker->stats.responses[RESPONSE_206]);
+	conn->range_index = 0;
+	connection_select_range(conn);
+
+	reply_start(conn);
+	reply_put_literal(conn, "HTTP/1.1 206 Partial Content\r\n");
+
+	if (conn->range_count == 1) {
+		reply_put_literal(conn, "Content-Length: ");
+		reply_put_number(conn, r->end - r->start + 1);
+		reply_put_literal(conn, "\r\nContent-Range: bytes ");
+		reply_put_number(conn, r->start);
+		reply_put_literal(conn, "-");
+		reply_put_number(conn, r->end);
+		reply_put_literal(conn, "/");
+		reply_put_number(conn, conn->file_size);
+		reply_put_literal(conn, "\r\n");
+		reply_put_validators(conn);
+		reply_put_line(conn, connection_header_line(conn));
+		return;
+	}
 
-	conn->file_pos = 0;
-	dlog(LOG_INFO, "file_size %ld", total_file_size);
-	do {
-		off_t offset = 0;
+	for (i = 0; i <= conn->range_count; i++) {
+		len += connection_part_header_len(conn, i);
+		if (i < conn->range_count)
+			len += r[i].end - r[i].start + 1;
+	}
 
-		sent_bytes = 1;
-		connection_start_async_io(conn);
-		struct io_event events[1];
+	reply_put_literal(conn,
+		"Content-Type: multipart/byteranges; boundary=" AWS_RANGE_BOUNDARY "\r\n"
+		"Content-Length: ");
+	reply_put_number(conn, len);
+	reply_put_literal(conn, "\r\n");
+	reply_put_validators(conn);
+	reply_put_line(conn, connection_header_line(conn));
+	connection_put_part_header(conn, 0);
+}
 
-		io_getevents(conn->ctx, 1, 1, events, NULL);
-		while (sent_bytes > 0 && offset < BUFSIZ) {
-			if (conn->state != STATE_ASYNC_ONGOING)
-				return -1;
-			sent_bytes = send(conn->sockfd, conn->recv_buffer + offset, BUFSIZ, 0);
-			offset += sent_bytes;
-		}
-		total_file_size -= BUFSIZ;
+void connection_finish_range(struct connection *conn)
+{
+	/*
+	 * The body of the current range has been sent. A multipart reply goes
+	 * on with the header of the next part, or the closing boundary, which
+	 * are sent like the reply header before the range they precede.
+	 */
+	if (conn->range_count < 2 || conn->range_index == conn->range_count) {
+		connection_set_state(conn, STATE_DATA_SENT);
+		return;
+	}
 
-		conn->state = STATE_DATA_SENT;
-		conn->file_pos += BUFSIZ;
-		close(conn->fd);
-	} while (total_file_size > 0);
+	conn->range_index++;
+	reply_start(conn);
+	connection_put_part_header(conn, conn->range_index);
+	connection_select_range(conn);
+	connection_set_state(conn, STATE_SENDING_HEADER);
+}
 
-	return 0;
+static void connection_prepare_send_error(struct connection *conn, const struct header_line *status)
+{
+	/* Prepare the connection buffer to send an empty error reply. */
+	reply_start(conn);
+	reply_put_literal(conn, "HTTP/1.1 ");
+	reply_put_line(conn, status);
+	reply_put_literal(conn, "\r\nContent-Length: 0\r\n");
+	reply_put_line(conn, connection_header_line(conn));
 }
 
-void extract_and_set_filename(struct connection *conn)
+static void connection_prepare_send_404(struct connection *conn)
 {
-	const char *request_start = strstr(conn->recv_buffer, "GET /");
+	/* Prepare the connection buffer to send the 404 header. */
+	static const struct header_line status = HEADER_LINE("404 Not Found");
 
-	request_start += 5;
-	const char *request_end = strstr(request_start, "HTTP");
+	STATS_INC(conn->worker->stats.responses[RESPONSE_404]);
+	connection_prepare_send_error(conn, &status);
+}
 
-	size_t filename_length = request_end - request_start;
+static void connection_prepare_send_416(struct connection *conn)
+{
+	/* None of the requested ranges overlaps the file. */
+	STATS_INC(conn->worker->stats.responses[RESPONSE_416]);
+	reply_start(conn);
+	reply_put_literal(conn,
+		"HTTP/1.1 416 Range Not Satisfiable\r\n"
+		"Content-Length: 0\r\n"
+		"Content-Range: bytes */");
+	reply_put_number(conn, conn->file_size);
+	reply_put_literal(conn, "\r\n");
+	reply_put_line(conn, connection_header_line(conn));
+}
 
-	snprintf(conn->filename, sizeof(conn->filename), "./%.*s", (int)filename_length, request_start);
-	dlog(LOG_INFO, "Length of the extracted filename: %ld\n", strlen(conn->filename));
+static void connection_prepare_send_304(struct connection *conn)
+{
+	/* The client's copy is current: send the validators, and no body. */
+	STATS_INC(conn->worker->stats.responses[RESPONSE_304]);
+	reply_start(conn);
+	reply_put_literal(conn, "HTTP/1.1 304 Not Modified\r\n");
+	reply_put_validators(conn);
+	reply_put_line(conn, connection_header_line(conn));
 }
 
-void handle_input(struct connection *conn)
+static void connection_prepare_send_generated(struct connection *conn)
 {
-	ssize_t bytes_received;
-	char buffer[BUFSIZ];
-	size_t current_position = 0;
+	/*
+	 * Start the handler on the rest of the path and prepare the reply
+	 * header. The length of the body is not known, so it is sent chunked,
+	 * or, to an HTTP/1.0 client, delimited by closing the connection.
+	 */
+	const struct handler *h = conn->handler;
+	size_t skip = sizeof(AWS_DOCUMENT_ROOT) - 1 + h->prefix_len;
 
-	while (1) {
-		bytes_received = recv(conn->sockfd, buffer, BUFSIZ, 0);
-		dlog(LOG_INFO, "Number of bytes received: %d\n", (int)bytes_received);
+	memset(conn->handler_state, 0, sizeof(conn->handler_state));
+	if (h->start(conn->handler_state, conn->filename + skip, conn->filename_len - skip) < 0) {
+		conn->handler = NULL;
+		connection_prepare_send_404(conn);
+		connection_set_state(conn, STATE_SENDING_404);
+		return;
+	}
 
-		if (bytes_received <= 0) {
-			if (bytes_received == 0)
-				dlog(LOG_INFO, "Connection closed by client\n");
-			else
-				perror("recv");
+	conn->res_type = RESOURCE_TYPE_HANDLER;
+	conn->chunked = conn->request_parser.http_major > 1 ||
+		(conn->request_parser.http_major == 1 && conn->request_parser.http_minor >= 1);
+	if (!conn->chunked)
+		conn->keep_alive = 0;
+
+	STATS_INC(conn->worker->stats.responses[RESPONSE_200]);
+	reply_start(conn);
+	reply_put_literal(conn, "HTTP/1.1 200 OK\r\nContent-Type: ");
+	reply_put(conn, h->content_type, h->content_type_len);
+	reply_put_literal(conn, "\r\n");
+	if (conn->chunked)
+		reply_put_literal(conn, "Transfer-Encoding: chunked\r\n");
+	reply_put_line(conn, connection_header_line(conn));
+	connection_set_state(conn, STATE_SENDING_HEADER);
+}
 
-			handle_output(conn);
-			close(conn->sockfd);
-			return;
-		}
-		if (current_position + bytes_received < sizeof(conn->recv_buffer)) {
-			memcpy(conn->recv_buffer + current_position, buffer, bytes_received);
-			current_position += bytes_received;
-			conn->recv_len = current_position;
-			conn->recv_buffer[current_position] = '\0';
+/* room left in front of a generated piece for its chunk size line */
+#define CHUNK_HEAD_ROOM		(2 * sizeof(size_t) + 2)
 
-			dlog(LOG_INFO, "Received string: %s\n", conn->recv_buffer);
-			const char *http_end = strstr(conn->recv_buffer, "\r\n\r\n");
+void connection_next_chunk(struct connection *conn)
+{
+	/*
+	 * Have the handler generate the next piece of the body, and point body
+	 * and send_len at it. After the last piece comes the empty chunk that
+	 * ends a chunked body. Moves on to STATE_SENDING_DATA, or to
+	 * STATE_DATA_SENT once the body is over.
+	 */
+	char *data;
+	char *p;
+	char *end;
+	ssize_t n;
 
-			if (http_end != NULL)
-				parse_header(conn);
-		} else {
-			dlog(LOG_INFO, "Received data exceeds buffer size\n");
-			handle_output(conn);
+	if (conn->body_done) {
+		connection_set_state(conn, STATE_DATA_SENT);
+		return;
+	}
+
+	connection_get_aio_buffers(conn);
+	data = conn->aio_bufs[0].data;
+
+	if (!conn->chunked) {
+		n = conn->handler->generate(conn->handler_state, data, AWS_AIO_BUF_SIZE);
+		p = data;
+	} else {
+		/* The size line goes in front of the data, and a CRLF after it. */
+		n = conn->handler->generate(conn->handler_state, data + CHUNK_HEAD_ROOM,
+					    AWS_AIO_BUF_SIZE - CHUNK_HEAD_ROOM - 2);
+		p = data + CHUNK_HEAD_ROOM;
+	}
+
+	if (n < 0) {
+		dlog(LOG_INFO, "Handler failed on %s\n", conn->filename);
+		connection_set_state(conn, STATE_CONNECTION_CLOSED);
+		return;
+	}
+
+	if (n == 0) {
+		conn->body_done = 1;
+		if (!conn->chunked) {
+			connection_set_state(conn, STATE_DATA_SENT);
 			return;
 		}
+		memcpy(data, "0\r\n\r\n", 5);
+		conn->body = data;
+		conn->send_len = 5;
+	} else if (conn->chunked) {
+		end = p + n;
+		*end++ = '\r';
+		*end++ = '\n';
+		*--p = '\n';
+		*--p = '\r';
+		do {
+			*--p = "0123456789abcdef"[n & 0xf];
+			n >>= 4;
+		} while (n > 0);
+		conn->body = p;
+		conn->send_len = end - p;
+	} else {
+		conn->body = p;
+		conn->send_len = n;
 	}
+
+	conn->send_pos = 0;
+	connection_set_state(conn, STATE_SENDING_DATA);
 }
 
-void handle_output(struct connection *conn)
+static int connection_etag_matches(struct connection *conn, const struct header_value *h)
 {
-	ssize_t bytes_sent;
-
-	dlog(LOG_INFO, "buffer: %s\n", conn->recv_buffer);
-	const char *http_position = strstr(conn->recv_buffer, "HTTP");
-
-	if (http_position != NULL) {
-		extract_and_set_filename(conn);
+	/*
+	 * Weak comparison of the file's ETag against an If-None-Match list
+	 * (RFC 9110, section 13.1.2): a W/ prefix is ignored, * matches any.
+	 */
+	const char *p = conn->recv_buffer + h->off;
+	const char *end = p + h->len;
+	const char *etag = conn->file->etag;
+	size_t etag_len = conn->file->etag_len;
+	const char *tag, *tag_end;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		tag = p;
+		while (p < end && *p != ',')
+			p++;
+		tag_end = p;
+		while (tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t'))
+			tag_end--;
+		if (tag == tag_end)
+			break;
 
-		conn->filename[strlen(conn->filename) - 1] = 0;
-		dlog(LOG_INFO, "filename: %s\n", conn->filename);
-		int file_fd = open(conn->filename, O_RDONLY);
+		if (tag_end - tag == 1 && *tag == '*')
+			return 1;
+		if (tag_end - tag >= 2 && tag[0] == 'W' && tag[1] == '/')
+			tag += 2;
+		if ((size_t)(tag_end - tag) == etag_len && memcmp(tag, etag, etag_len) == 0)
+			return 1;
+	}
 
-		if (file_fd == -1) {
-			connection_prepare_send_404(conn);
-			int total_sent = 0;
+	return 0;
+}
 
-			while (1) {
-				bytes_sent = send(conn->sockfd, conn->send_buffer + total_sent, conn->send_len - total_sent, 0);
-				if (bytes_sent == 0)
-					break;
+static int connection_not_modified(struct connection *conn)
+{
+	/*
+	 * Evaluate the request's preconditions on the open file's metadata
+	 * alone. If-None-Match takes precedence over If-Modified-Since, which
+	 * holds when the file is no newer than the date given.
+	 */
+	struct header_value *inm = &conn->headers[REQUEST_HEADER_IF_NONE_MATCH];
+	struct header_value *ims = &conn->headers[REQUEST_HEADER_IF_MODIFIED_SINCE];
+	char date[64];
+	struct tm tm;
+	char *rest;
+
+	if (inm->len > 0)
+		return connection_etag_matches(conn, inm);
+
+	if (ims->len == 0 || ims->len >= sizeof(date))
+		return 0;
+
+	memcpy(date, conn->recv_buffer + ims->off, ims->len);
+	date[ims->len] = '\0';
+	memset(&tm, 0, sizeof(tm));
+	rest = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (rest == NULL || *rest != '\0')
+		return 0;
+
+	return conn->file->st.st_mtime <= timegm(&tm);
+}
 
-				total_sent += bytes_sent;
-			}
-			dlog(LOG_INFO, "Failed to open file %s\n", conn->filename);
-			return;
+static int connection_accepted_encoding(struct connection *conn, unsigned int available)
+{
+	/*
+	 * Pick the available variant the Accept-Encoding header rates highest,
+	 * zstd winning a tie; an unlisted coding gets the rating of "*", if
+	 * any. Returns an enum file_encoding, or -1 to send the file itself.
+	 */
+	struct header_value *h = &conn->headers[REQUEST_HEADER_ACCEPT_ENCODING];
+	const char *p = conn->recv_buffer + h->off;
+	const char *end = p + h->len;
+	int quality[FILE_ENCODING_COUNT];
+	int star = -1;
+	int best = -1;
+	const char *name;
+	size_t name_len;
+	int q, scale, i;
+
+	for (i = 0; i < FILE_ENCODING_COUNT; i++)
+		quality[i] = -1;
+
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		name = p;
+		while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+			p++;
+		name_len = p - name;
+
+		/* Quality in thousandths; only q is expected as a parameter. */
+		q = 1000;
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (end - p >= 3 && p[0] == ';' && (p[1] == 'q' || p[1] == 'Q') && p[2] == '=') {
+			p += 3;
+			q = 0;
+			if (p < end && (*p == '0' || *p == '1'))
+				q = (*p++ - '0') * 1000;
+			if (p < end && *p == '.')
+				for (p++, scale = 100; p < end && *p >= '0' && *p <= '9'; p++, scale /= 10)
+					q += (*p - '0') * scale;
+			if (q > 1000)
+				q = 1000;
 		}
+		while (p < end && *p != ',')
+			p++;
 
-		off_t file_size = lseek(file_fd, 0, SEEK_END);
-
-		conn->file_size = file_size;
-
-		if (file_size == -1) {
-			dlog(LOG_INFO, "Error in lseek: %s\n", strerror(errno));
-			close(file_fd);
-			return;
+		if (name_len == 1 && *name == '*') {
+			star = q;
+			continue;
 		}
+		for (i = 0; i < FILE_ENCODING_COUNT; i++)
+			if (name_len == strlen(file_encoding_names[i]) &&
+			    strncasecmp(name, file_encoding_names[i], name_len) == 0)
+				quality[i] = q;
+	}
 
-		lseek(file_fd, 0, SEEK_SET);
+	for (i = FILE_ENCODING_COUNT - 1; i >= 0; i--) {
+		if (!(available & (1U << i)))
+			continue;
+		if (quality[i] < 0)
+			quality[i] = star;
+		if (quality[i] > 0 && (best < 0 || quality[i] > quality[best]))
+			best = i;
+	}
 
-		snprintf(conn->send_buffer, sizeof(conn->send_buffer),
-			"HTTP/1.1 200 OK\r\n"
-			"Content-Length: %ld\r\n"
-			"Connection: close\r\n"
-			"\r\n",
-			file_size);
-		conn->send_len = strlen(conn->send_buffer);
-		dlog(LOG_INFO, "Number of characters sent in header: %ld\n", conn->send_len);
+	return best;
+}
 
-		int total_sent = 0;
+static void connection_open_variant(struct connection *conn)
+{
+	/*
+	 * Swap the open file for a precompressed variant the client accepts.
+	 * The variant is a file of its own in the cache, so it is sent just
+	 * like the original and has validators of its own.
+	 */
+	struct file_cache_entry *variant;
+	size_t len = conn->filename_len;
+	const char *suffix;
+	int encoding;
+
+	conn->vary = 1;
+	encoding = connection_accepted_encoding(conn, conn->file->encodings);
+	if (encoding < 0)
+		return;
 
-		while (1) {
-			bytes_sent = send(conn->sockfd, conn->send_buffer + total_sent, conn->send_len - total_sent, 0);
-			if (bytes_sent == 0)
-				break;
-			total_sent += bytes_sent;
-		}
+	suffix = file_encoding_suffixes[encoding];
+	if (connection_append_filename(conn, suffix, strlen(suffix)) < 0)
+		return;
 
-		dlog(LOG_INFO, "Sent header: %s\n", conn->send_buffer);
-		conn->fd = file_fd;
-		close(file_fd);
-		if (connection_get_resource_type(conn) == RESOURCE_TYPE_STATIC)
-			connection_send_static(conn);
-		else
-			connection_send_dynamic(conn);
+	variant = file_cache_open(&conn->worker->files, conn->filename);
+	if (variant == NULL) {
+		conn->filename_len = len;
+		conn->filename[len] = '\0';
+		return;
 	}
 
-	if (bytes_sent <= 0) {
-		dlog(LOG_INFO, "Client closed the connection\n");
-		close(conn->sockfd);
+	connection_close_file(conn);
+	conn->file = variant;
+	conn->fd = variant->fd;
+	conn->file_size = variant->st.st_size;
+	conn->file_end = conn->file_size;
+	conn->encoding = encoding;
+}
+
+static int parse_offset(const char **p, const char *end, off_t *value)
+{
+	/* Read a decimal byte offset; returns -1 if there is none. */
+	const char *s = *p;
+	off_t v = 0;
+
+	while (s < end && *s >= '0' && *s <= '9') {
+		if (v >= ((off_t)1 << 58))
+			return -1;
+		v = v * 10 + (*s - '0');
+		s++;
 	}
+	if (s == *p)
+		return -1;
+
+	*p = s;
+	*value = v;
+
+	return 0;
 }
 
-void handle_client(uint32_t event, struct connection *conn)
+static int connection_parse_range(struct connection *conn)
 {
-	/* Handle new client. There can be input and output connections.
-	 * Take care of what happened at the end of a connection.
+	/*
+	 * Parse the Range header into conn->ranges, clipped to the file and
+	 * dropping those that lie past its end (RFC 9110, section 14.1.2).
+	 * Returns the number of ranges kept, or -1 if the header is malformed
+	 * or asks for more ranges than are served, in which case the whole
+	 * file is sent.
 	 */
-	if (event & EPOLLIN)
-		handle_input(conn);
+	struct header_value *range = &conn->headers[REQUEST_HEADER_RANGE];
+	const char *p = conn->recv_buffer + range->off;
+	const char *end = p + range->len;
+	off_t size = conn->file_size;
+	off_t first, last;
+	int n = 0;
 
-	if (event & EPOLLOUT) {
-		conn->state = STATE_SENDING_DATA;
-		handle_output(conn);
+	if (range->len < 6 || strncasecmp(p, "bytes=", 6) != 0)
+		return -1;
+	p += 6;
+
+	while (1) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+
+		if (p < end && *p == '-') {
+			/* suffix range: the last bytes of the file */
+			p++;
+			if (parse_offset(&p, end, &last) < 0)
+				return -1;
+			first = size > last ? size - last : 0;
+			last = size - 1;
+			if (first > last)
+				first = size;
+		} else {
+			if (parse_offset(&p, end, &first) < 0)
+				return -1;
+			if (p >= end || *p != '-')
+				return -1;
+			p++;
+			last = size - 1;
+			if (p < end && *p >= '0' && *p <= '9') {
+				if (parse_offset(&p, end, &last) < 0 || last < first)
+					return -1;
+				if (last > size - 1)
+					last = size - 1;
+			}
+		}
+
+		if (first < size) {
+			if (n == AWS_MAX_RANGES)
+				return -1;
+			conn->ranges[n].start = first;
+			conn->ranges[n].end = last;
+			n++;
+		}
 
-		if (conn->state == STATE_SENDING_DATA)
-			connection_send_data(conn);
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p == end)
+			break;
+		if (*p != ',')
+			return -1;
+		p++;
 	}
+
+	return n;
 }
 
-int main(void)
+static int connection_filename_starts(struct connection *conn, const char *prefix, size_t len)
 {
-	int rc;
+	return conn->filename_len >= len && memcmp(conn->filename, prefix, len) == 0;
+}
 
-	/* Initialize asynchronous operations. */
-	io_setup(1, &ctx);
+static enum resource_type connection_get_resource_type(struct connection *conn)
+{
+	/* Only files below the static and dynamic folders are served. */
+	if (conn->dot_dot)
+		return RESOURCE_TYPE_NONE;
+	if (connection_filename_starts(conn, AWS_ABS_STATIC_FOLDER,
+				       sizeof(AWS_ABS_STATIC_FOLDER) - 1))
+		return RESOURCE_TYPE_STATIC;
+	else if (connection_filename_starts(conn, AWS_ABS_DYNAMIC_FOLDER,
+					    sizeof(AWS_ABS_DYNAMIC_FOLDER) - 1))
+		return RESOURCE_TYPE_DYNAMIC;
+	else
+		return RESOURCE_TYPE_NONE;
+}
 
-	/* Initialize multiplexing. */
-	epollfd = w_epoll_create();
+static void connection_init_parser(struct connection *conn)
+{
+	/* Ready the parser for a request, recording where its parts lie. */
+	http_parser_init(&conn->request_parser, HTTP_REQUEST);
+	conn->request_parser.data = conn;
+	conn->request_spans.headers = conn->request_headers;
+	conn->request_spans.max_headers = AWS_REQUEST_HEADERS_MAX;
+	conn->request_parser.spans = &conn->request_spans;
+}
 
-	/* Create server socket. */
-	listenfd = tcp_create_listener(AWS_LISTEN_PORT, DEFAULT_LISTEN_BACKLOG);
+void connection_set_state(struct connection *conn, enum connection_state state)
+{
+	/* Keep the count of the worker's connections by state current. */
+	struct worker_stats *stats = &conn->worker->stats;
 
-	rc = w_epoll_add_fd_in(epollfd, listenfd);
+	STATS_DEC(stats->states[conn->state]);
+	STATS_INC(stats->states[state]);
+	conn->state = state;
+}
 
-	/* Uncomment the following line for debugging. */
-	dlog(LOG_INFO, "Server waiting for connections on port %d\n", AWS_LISTEN_PORT);
+struct connection *connection_create(struct worker *w, int sockfd)
+{
+	/*
+	 * Initialize connection structure on given socket. The structure comes
+	 * from the worker's pool and holds no buffer worth clearing.
+	 */
+	struct connection *conn = pool_get(&w->conn_pool);
 
-	/* server main loop */
-	while (1) {
-		struct epoll_event rev;
+	DIE(conn == NULL, "malloc");
+	STATS_INC(w->stats.accepted);
 
-		/* Wait for events. */
-		rc = w_epoll_wait_infinite(epollfd, &rev);
-		DIE(rc < 0, "w_epoll_wait_infinite");
+	conn->worker = w;
+	conn->sockfd = sockfd;
+	conn->fd = -1;
+	conn->file = NULL;
+	conn->filename = conn->filename_inline;
+	connection_reset_filename(conn);
+	conn->recv_buffer = NULL;
+	conn->recv_len = 0;
+	conn->send_len = 0;
+	conn->send_pos = 0;
+	conn->file_pos = 0;
+	conn->file_size = 0;
+	conn->file_end = 0;
+	conn->encoding = -1;
+	conn->vary = 0;
+	conn->range_count = 0;
+	conn->range_index = 0;
+	conn->res_type = RESOURCE_TYPE_NONE;
+	conn->state = STATE_INITIAL;
+	STATS_INC(w->stats.states[STATE_INITIAL]);
+	memset(conn->headers, 0, sizeof(conn->headers));
+	conn->keep_alive = 0;
+	conn->bad_request = 0;
+	conn->request_len = 0;
+	conn->aio_bufs = NULL;
+	conn->aio_head = 0;
+	conn->aio_tail = 0;
+	conn->aio_used = 0;
+	conn->aio_offset = 0;
+	conn->aio_outstanding = 0;
+	conn->pipefd[0] = -1;
+	conn->pipefd[1] = -1;
+	conn->pipe_len = 0;
+	conn->body = NULL;
+	conn->body_len = 0;
+	conn->handler = NULL;
+	conn->chunked = 0;
+	conn->body_done = 0;
+	conn->first_byte_sent = 0;
+	conn->next_closed = NULL;
+	timer_init(&conn->timer);
+	conn->timer_kind = TIMER_NONE;
+	conn->file_slot = -1;
+	conn->io_buf = NULL;
+	conn->io_buf_index = -1;
+	conn->uring_readable = 0;
+	connection_init_parser(conn);
 
-		/* Switch event types; consider
-		 *   - new connection requests (on server socket)
-		 *   - socket communication (on connection sockets)
-		 */
-		if (rev.data.fd == listenfd) {
-			if (rev.events & EPOLLIN)
-				handle_new_connection();
-		} else {
-			handle_client(rev.events, rev.data.ptr);
-		}
+	return conn;
+}
+
+void connection_get_recv_buffer(struct connection *conn)
+{
+	if (conn->recv_buffer == NULL) {
+		conn->recv_buffer = pool_get(&conn->worker->recv_pool);
+		DIE(conn->recv_buffer == NULL, "malloc");
+	}
+}
+
+static void connection_put_recv_buffer(struct connection *conn)
+{
+	if (conn->recv_buffer != NULL) {
+		pool_put(&conn->worker->recv_pool, conn->recv_buffer);
+		conn->recv_buffer = NULL;
+	}
+}
+
+void connection_get_aio_buffers(struct connection *conn)
+{
+	if (conn->aio_bufs == NULL) {
+		conn->aio_bufs = pool_get(&conn->worker->aio_pool);
+		DIE(conn->aio_bufs == NULL, "malloc");
+	}
+}
+
+static void connection_put_aio_buffers(struct connection *conn)
+{
+	if (conn->aio_bufs != NULL) {
+		pool_put(&conn->worker->aio_pool, conn->aio_bufs);
+		conn->aio_bufs = NULL;
+	}
+}
+
+void connection_free(struct connection *conn)
+{
+	/* Hand the structure and anything it borrowed back to the worker. */
+	STATS_DEC(conn->worker->stats.states[conn->state]);
+	connection_put_recv_buffer(conn);
+	connection_put_aio_buffers(conn);
+	connection_reset_filename(conn);
+	pool_put(&conn->worker->conn_pool, conn);
+}
+
+void connection_start_async_io(struct connection *conn)
+{
+	/*
+	 * Keep every free buffer of the ring busy with a read of the next file
+	 * chunk, so the disk works ahead of the socket. The reads are queued on
+	 * the worker and submitted with those of other connections.
+	 */
+	struct worker *w = conn->worker;
+	struct aio_buffer *buf;
+	size_t len;
+
+	connection_get_aio_buffers(conn);
+
+	while (conn->aio_used < AWS_AIO_BUFFERS && conn->aio_offset < conn->file_end) {
+		buf = &conn->aio_bufs[conn->aio_tail];
+		len = conn->file_end - conn->aio_offset;
+		if (len > sizeof(buf->data))
+			len = sizeof(buf->data);
+
+		io_prep_pread(&buf->iocb, conn->fd, buf->data, len, conn->aio_offset);
+		io_set_eventfd(&buf->iocb, w->aio_eventfd);
+		buf->iocb.data = conn;
+		buf->len = len;
+		buf->ready = 0;
+
+		buf->next_pending = NULL;
+		if (w->aio_pending_tail != NULL)
+			w->aio_pending_tail->next_pending = buf;
+		else
+			w->aio_pending_head = buf;
+		w->aio_pending_tail = buf;
+
+		conn->aio_offset += len;
+		conn->aio_tail = (conn->aio_tail + 1) % AWS_AIO_BUFFERS;
+		conn->aio_used++;
+		conn->aio_outstanding++;
+	}
+}
+
+void connection_complete_async_io(struct connection *conn, struct io_event *event)
+{
+	/* Account for one finished read and mark its buffer ready. */
+	struct aio_buffer *buf = (struct aio_buffer *)event->obj;
+
+	conn->aio_outstanding--;
+	if (conn->sockfd < 0) {
+		/* Removed while the read was in flight. */
+		if (conn->aio_outstanding == 0)
+			connection_release(conn);
+		return;
+	}
+
+	if ((long)event->res != (long)buf->len) {
+		dlog(LOG_ERR, "Asynchronous read failed on %s\n", conn->filename);
+		connection_set_state(conn, STATE_CONNECTION_CLOSED);
+		handle_output(conn);
+		return;
+	}
+	buf->ready = 1;
+
+	/* Buffers are sent in order; later ones wait for the head. */
+	if (buf == &conn->aio_bufs[conn->aio_head])
+		handle_output(conn);
+}
+
+void connection_release(struct connection *conn)
+{
+	/*
+	 * Queue the structure to be freed once the current batch of events has
+	 * been handled, as later events of the same batch may still point to it.
+	 */
+	conn->next_closed = conn->worker->closed;
+	conn->worker->closed = conn;
+}
+
+static unsigned long worker_now_tick(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (ts.tv_sec * 1000UL + ts.tv_nsec / 1000000) / AWS_TIMER_TICK_MS;
+}
+
+void connection_update_timer(struct connection *conn)
+{
+	/*
+	 * Hold the connection to the deadline of what it is waiting for. The
+	 * request deadline runs from the request's first byte and is not
+	 * pushed back by a client trickling bytes in; the send deadline is
+	 * pushed back on every wakeup that can make progress.
+	 */
+	struct worker *w = conn->worker;
+	enum connection_timer kind;
+	unsigned long timeout;
+
+	switch (conn->state) {
+	case STATE_INITIAL:
+		kind = TIMER_IDLE;
+		timeout = AWS_IDLE_TIMEOUT;
+		break;
+	case STATE_RECEIVING_DATA:
+		if (conn->timer_kind == TIMER_REQUEST)
+			return;
+		kind = TIMER_REQUEST;
+		timeout = AWS_REQUEST_TIMEOUT;
+		break;
+	default:
+		kind = TIMER_SEND;
+		timeout = AWS_SEND_TIMEOUT;
+		break;
+	}
+
+	conn->timer_kind = kind;
+	timer_wheel_add(&w->timers, &conn->timer,
+			worker_now_tick() + timeout * 1000 / AWS_TIMER_TICK_MS);
+}
+
+static void connection_timer_expired(struct timer *t)
+{
+	struct connection *conn = (struct connection *)((char *)t - offsetof(struct connection, timer));
+
+	dlog(LOG_INFO, "Connection timed out in state %d\n", conn->state);
+	conn->timer_kind = TIMER_NONE;
+
+	/*
+	 * An io_uring connection always has an operation in flight: shutting
+	 * the socket down makes it fail, and the connection closes from there.
+	 */
+	if (use_uring)
+		shutdown(conn->sockfd, SHUT_RDWR);
+	else
+		connection_remove(conn);
+}
+
+void worker_expire_timers(struct worker *w)
+{
+	if (w->timers.count > 0)
+		timer_wheel_expire(&w->timers, worker_now_tick(), connection_timer_expired);
+}
+
+int worker_timer_timeout(struct worker *w)
+{
+	/* Milliseconds to the next tick, or -1 if no timer is armed. */
+	struct timespec ts;
+	long ms;
+
+	if (w->timers.count == 0)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	ms = ts.tv_nsec / 1000000;
+
+	return AWS_TIMER_TICK_MS - ms % AWS_TIMER_TICK_MS;
+}
+
+void connection_account_sent(struct connection *conn, enum sent_from from, size_t bytes)
+{
+	/* Count bytes sent; the first ones of a reply give its TTFB. */
+	struct worker_stats *stats = &conn->worker->stats;
+
+	STATS_ADD(stats->bytes[from], bytes);
+	if (!conn->first_byte_sent && bytes > 0) {
+		conn->first_byte_sent = 1;
+		stats_hist_record(&stats->ttfb, stats_now_us() - conn->request_time);
+	}
+}
+
+void connection_account_done(struct connection *conn)
+{
+	stats_hist_record(&conn->worker->stats.response_time,
+			  stats_now_us() - conn->request_time);
+}
+
+void worker_publish_stats(struct worker *w)
+{
+	/*
+	 * Publish the figures kept by the worker alone, once per timer tick.
+	 * An idle worker publishes before it sleeps, so that no stale figure
+	 * outlives its connections.
+	 */
+	unsigned long tick = worker_now_tick();
+
+	if (tick == w->stats_tick && w->timers.count > 0)
+		return;
+	w->stats_tick = tick;
+
+	STATS_SET(w->stats.aio_in_flight, w->aio_in_flight);
+	STATS_SET(w->stats.cache_misses, w->files.misses);
+	STATS_SET(w->stats.cache_evictions, w->files.evictions);
+}
+
+static int connection_get_pipe(struct connection *conn)
+{
+	/* Borrow the worker's empty pipe, or make one if it is lent out. */
+	struct worker *w = conn->worker;
+
+	if (conn->pipefd[0] >= 0)
+		return 0;
+
+	if (w->splice_pipe[0] >= 0) {
+		conn->pipefd[0] = w->splice_pipe[0];
+		conn->pipefd[1] = w->splice_pipe[1];
+		w->splice_pipe[0] = -1;
+		w->splice_pipe[1] = -1;
+		return 0;
+	}
+
+	return pipe2(conn->pipefd, O_NONBLOCK | O_CLOEXEC);
+}
+
+static void connection_put_pipe(struct connection *conn)
+{
+	/*
+	 * Give an empty pipe back to the worker, unless it already has one. A
+	 * pipe with bytes left in it is of no use to anyone else.
+	 */
+	struct worker *w = conn->worker;
+
+	if (conn->pipefd[0] < 0)
+		return;
+
+	if (conn->pipe_len == 0 && w->splice_pipe[0] < 0) {
+		w->splice_pipe[0] = conn->pipefd[0];
+		w->splice_pipe[1] = conn->pipefd[1];
+	} else {
+		close(conn->pipefd[0]);
+		close(conn->pipefd[1]);
+	}
+	conn->pipefd[0] = -1;
+	conn->pipefd[1] = -1;
+	conn->pipe_len = 0;
+}
+
+void connection_remove(struct connection *conn)
+{
+	/* Remove connection handler. */
+	timer_wheel_del(&conn->worker->timers, &conn->timer);
+	w_epoll_remove_ptr(conn->worker->epollfd, conn->sockfd, conn);
+	close(conn->sockfd);
+	conn->sockfd = -1;
+
+	connection_close_file(conn);
+	connection_put_pipe(conn);
+
+	connection_set_state(conn, STATE_CONNECTION_CLOSED);
+
+	/* Reads still queued or in flight target its buffers. */
+	if (conn->aio_outstanding == 0)
+		connection_release(conn);
+}
+
+void connection_reset_request(struct connection *conn)
+{
+	/*
+	 * Prepare a persistent connection for its next request. The structure
+	 * is reused as is; bytes of pipelined requests that arrived after the
+	 * current one are moved to the front of the receive buffer.
+	 */
+	connection_close_file(conn);
+
+	conn->recv_len -= conn->request_len;
+	if (conn->recv_len > 0)
+		memmove(conn->recv_buffer, conn->recv_buffer + conn->request_len, conn->recv_len);
+	else
+		connection_put_recv_buffer(conn);
+	conn->request_len = 0;
+	connection_put_aio_buffers(conn);
+
+	conn->send_len = 0;
+	conn->send_pos = 0;
+	conn->body = NULL;
+	conn->body_len = 0;
+	conn->handler = NULL;
+	conn->chunked = 0;
+	conn->body_done = 0;
+	conn->first_byte_sent = 0;
+	conn->file_pos = 0;
+	conn->file_size = 0;
+	conn->file_end = 0;
+	conn->encoding = -1;
+	conn->vary = 0;
+	conn->range_count = 0;
+	conn->range_index = 0;
+	memset(conn->headers, 0, sizeof(conn->headers));
+	conn->aio_head = 0;
+	conn->aio_tail = 0;
+	conn->aio_used = 0;
+	conn->aio_offset = 0;
+	connection_reset_filename(conn);
+	conn->res_type = RESOURCE_TYPE_NONE;
+	conn->keep_alive = 0;
+	conn->bad_request = 0;
+
+	connection_init_parser(conn);
+
+	connection_set_state(conn, STATE_INITIAL);
+	if (conn->recv_len) {
+		connection_set_state(conn, STATE_RECEIVING_DATA);
+		parse_header(conn);
+	}
+}
+
+void handle_new_connection(struct worker *w)
+{
+	int sockfd;
+	socklen_t addrlen;
+	struct sockaddr_in addr;
+	struct connection *conn;
+	char addr_str[INET_ADDRSTRLEN];
+	int rc;
+
+	/*
+	 * Accept every pending connection, not just one: a burst is absorbed
+	 * in a single wakeup. accept4(2) returns the socket already
+	 * non-blocking and close-on-exec.
+	 */
+	while (1) {
+		addrlen = sizeof(addr);
+		sockfd = accept4(w->listenfd, (SSA *)&addr, &addrlen,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sockfd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			ERR("accept4");
+			return;
+		}
+
+		inet_ntop(AF_INET, &addr.sin_addr, addr_str, sizeof(addr_str));
+		dlog(LOG_ERR, "Worker %d accepted connection from: %s:%d\n",
+		     w->id, addr_str, ntohs(addr.sin_port));
+
+		/* Instantiate new connection handler. */
+		conn = connection_create(w, sockfd);
+
+		/* Add socket to epoll; edge-triggered, so every wakeup is drained. */
+		rc = w_epoll_add_ptr_in_et(w->epollfd, sockfd, conn);
+		DIE(rc < 0, "w_epoll_add_ptr_in_et");
+
+		connection_update_timer(conn);
+	}
+}
+
+void receive_data(struct connection *conn)
+{
+	/* Receive everything available on the socket, without blocking. */
+	ssize_t bytes_received;
+
+	connection_get_recv_buffer(conn);
+
+	while (conn->recv_len < AWS_RECV_BUFFER_SIZE) {
+		bytes_received = recv(conn->sockfd, conn->recv_buffer + conn->recv_len,
+				      AWS_RECV_BUFFER_SIZE - conn->recv_len, 0);
+		if (bytes_received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			dlog(LOG_INFO, "recv: %s\n", strerror(errno));
+			connection_set_state(conn, STATE_CONNECTION_CLOSED);
+			return;
+		}
+		if (bytes_received == 0) {
+			dlog(LOG_INFO, "Connection closed by client\n");
+			connection_set_state(conn, STATE_CONNECTION_CLOSED);
+			return;
+		}
+
+		conn->recv_len += bytes_received;
+		connection_set_state(conn, STATE_RECEIVING_DATA);
+
+		parse_header(conn);
+		if (conn->state == STATE_REQUEST_RECEIVED)
+			return;
+	}
+
+	dlog(LOG_INFO, "Received data exceeds buffer size\n");
+	connection_set_state(conn, STATE_CONNECTION_CLOSED);
+}
+
+int parse_header(struct connection *conn)
+{
+	/*
+	 * Feed the bytes received since the last call to the HTTP parser. The
+	 * parser keeps its state between fragments, so every byte of a request
+	 * is scanned exactly once however the request was split by the network.
+	 */
+	size_t len = conn->recv_len - conn->request_len;
+	size_t parsed;
+
+	parsed = http_parser_execute(&conn->request_parser, &aws_parser_settings,
+				     conn->recv_buffer + conn->request_len, len);
+
+	if (conn->state == STATE_REQUEST_RECEIVED) {
+		/* Halted by on_message_complete on the request's last byte. */
+		conn->request_len += parsed + 1;
+		return 0;
+	}
+
+	conn->request_len += parsed;
+	if (parsed != len) {
+		/* Parse error; answer and drop the connection. */
+		conn->bad_request = 1;
+		connection_set_state(conn, STATE_REQUEST_RECEIVED);
+		return -1;
+	}
+
+	return 0;
+}
+
+int connection_open_file(struct connection *conn)
+{
+	/* Look the requested file up in the worker's cache of open files. */
+	conn->file = file_cache_open(&conn->worker->files, conn->filename);
+	if (conn->file == NULL)
+		return -1;
+
+	conn->fd = conn->file->fd;
+	conn->file_size = conn->file->st.st_size;
+	conn->file_end = conn->file_size;
+	conn->file_pos = 0;
+
+	return conn->fd;
+}
+
+void connection_close_file(struct connection *conn)
+{
+	/* Hand the file back to the cache; it stays open for later requests. */
+	if (conn->file == NULL)
+		return;
+
+	file_cache_release(&conn->worker->files, conn->file);
+	conn->file = NULL;
+	conn->fd = -1;
+}
+
+enum connection_state connection_send_static(struct connection *conn)
+{
+	/*
+	 * Send static data using sendfile(2), from file_pos to file_end. At most
+	 * AWS_SENDFILE_BUDGET bytes go out per wakeup so that a fast reader of
+	 * a large file does not starve the other connections of the worker.
+	 */
+	off_t offset = conn->file_pos;
+	size_t budget = AWS_SENDFILE_BUDGET;
+	size_t count;
+	ssize_t sent_bytes;
+
+	while (conn->file_pos < conn->file_end) {
+		if (budget == 0) {
+			/*
+			 * The socket may still be writable, which an edge
+			 * triggered wait would not report again: re-arm it so
+			 * the transfer resumes after the other ready events.
+			 */
+			if (w_epoll_update_ptr_out_et(conn->worker->epollfd, conn->sockfd, conn) < 0)
+				return STATE_CONNECTION_CLOSED;
+			return STATE_SENDING_DATA;
+		}
+
+		count = conn->file_end - conn->file_pos;
+		if (count > budget)
+			count = budget;
+
+		sent_bytes = sendfile(conn->sockfd, conn->fd, &offset, count);
+		if (sent_bytes < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return STATE_SENDING_DATA;
+			dlog(LOG_INFO, "Error in sendfile: %s\n", strerror(errno));
+			return STATE_CONNECTION_CLOSED;
+		}
+		if (sent_bytes == 0) {
+			dlog(LOG_INFO, "File %s shrunk while sending\n", conn->filename);
+			return STATE_CONNECTION_CLOSED;
+		}
+		conn->file_pos = offset;
+		budget -= sent_bytes;
+		connection_account_sent(conn, SENT_SENDFILE, sent_bytes);
+	}
+
+	connection_finish_range(conn);
+	return conn->state;
+}
+
+static enum connection_state connection_send_splice(struct connection *conn)
+{
+	/*
+	 * Send a dynamic file with no copy through user space: splice(2) its
+	 * pages into a pipe, then the pipe into the socket. Only as much as
+	 * the pipe holds is moved at once, and the pipe is handed back as soon
+	 * as the socket took all of it, so one pipe serves the whole worker
+	 * unless sockets fill up. The budget is that of sendfile(2).
+	 */
+	size_t budget = AWS_SENDFILE_BUDGET;
+	loff_t offset;
+	size_t count;
+	ssize_t n;
+
+	while (conn->file_pos < conn->file_end || conn->pipe_len > 0) {
+		if (conn->pipe_len == 0) {
+			if (budget == 0) {
+				/* As in connection_send_static(). */
+				if (w_epoll_update_ptr_out_et(conn->worker->epollfd, conn->sockfd, conn) < 0)
+					return STATE_CONNECTION_CLOSED;
+				return STATE_SENDING_DATA;
+			}
+			if (connection_get_pipe(conn) < 0) {
+				dlog(LOG_INFO, "pipe2: %s\n", strerror(errno));
+				return STATE_CONNECTION_CLOSED;
+			}
+
+			count = conn->file_end - conn->file_pos;
+			if (count > budget)
+				count = budget;
+			if (count > AWS_SPLICE_PIPE_SIZE)
+				count = AWS_SPLICE_PIPE_SIZE;
+
+			offset = conn->file_pos;
+			n = splice(conn->fd, &offset, conn->pipefd[1], NULL, count,
+				   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0) {
+				dlog(LOG_INFO, "splice from file: %s\n", strerror(errno));
+				return STATE_CONNECTION_CLOSED;
+			}
+			if (n == 0) {
+				dlog(LOG_INFO, "File %s shrunk while sending\n", conn->filename);
+				return STATE_CONNECTION_CLOSED;
+			}
+			conn->file_pos += n;
+			conn->pipe_len = n;
+			budget -= n;
+		}
+
+		n = splice(conn->pipefd[0], NULL, conn->sockfd, NULL, conn->pipe_len,
+			   SPLICE_F_MOVE | SPLICE_F_NONBLOCK |
+			   (conn->file_pos < conn->file_end ? SPLICE_F_MORE : 0));
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return STATE_SENDING_DATA;
+			dlog(LOG_INFO, "splice to socket: %s\n", strerror(errno));
+			return STATE_CONNECTION_CLOSED;
+		}
+		conn->pipe_len -= n;
+		connection_account_sent(conn, SENT_SPLICE, n);
+		if (conn->pipe_len == 0)
+			connection_put_pipe(conn);
+	}
+
+	connection_finish_range(conn);
+	return conn->state;
+}
+
+int connection_send_data(struct connection *conn)
+{
+	/* Send as much data as possible from the connection send buffer.
+	 * Returns the number of bytes sent or -1 if an error occurred
+	 */
+	ssize_t bytes_sent;
+	size_t total_sent = 0;
+	int flags = MSG_NOSIGNAL;
+
+	/*
+	 * A header followed by a sendfile(2) body is held back until the body
+	 * joins it, rather than going out in a segment of its own.
+	 */
+	if (conn->state == STATE_SENDING_HEADER &&
+	    (conn->file_pos < conn->file_end || conn->res_type == RESOURCE_TYPE_HANDLER))
+		flags |= MSG_MORE;
+
+	while (conn->send_pos < conn->send_len) {
+		bytes_sent = send(conn->sockfd, conn->send_buffer + conn->send_pos,
+				  conn->send_len - conn->send_pos, flags);
+		if (bytes_sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			dlog(LOG_INFO, "send: %s\n", strerror(errno));
+			return -1;
+		}
+		conn->send_pos += bytes_sent;
+		total_sent += bytes_sent;
+		connection_account_sent(conn, SENT_HEADER, bytes_sent);
+	}
+
+	return total_sent;
+}
+
+static int connection_send_header_dynamic(struct connection *conn)
+{
+	/*
+	 * Send the reply header together with the first chunk of the file in
+	 * one sendmsg(2), once that chunk has been read. On return, send_pos
+	 * counts the bytes of the chunk already sent. Returns -1 on error.
+	 */
+	struct aio_buffer *buf;
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t header_left;
+	ssize_t bytes_sent;
+
+	if (conn->aio_used == 0 && conn->aio_offset == conn->file_pos) {
+		connection_start_async_io(conn);
+		return 0;
+	}
+	buf = &conn->aio_bufs[conn->aio_head];
+	if (!buf->ready)
+		return 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	while (conn->state == STATE_SENDING_HEADER) {
+		header_left = conn->send_len - conn->send_pos;
+		iov[0].iov_base = conn->send_buffer + conn->send_pos;
+		iov[0].iov_len = header_left;
+		iov[1].iov_base = buf->data;
+		iov[1].iov_len = buf->len;
+
+		bytes_sent = sendmsg(conn->sockfd, &msg, MSG_NOSIGNAL);
+		if (bytes_sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			dlog(LOG_INFO, "sendmsg: %s\n", strerror(errno));
+			return -1;
+		}
+		if ((size_t)bytes_sent < header_left) {
+			conn->send_pos += bytes_sent;
+			connection_account_sent(conn, SENT_HEADER, bytes_sent);
+			continue;
+		}
+		connection_account_sent(conn, SENT_HEADER, header_left);
+		connection_account_sent(conn, SENT_ASYNC, bytes_sent - header_left);
+
+		dlog(LOG_INFO, "Sent header: %s\n", conn->send_buffer);
+		conn->send_pos = bytes_sent - header_left;
+		connection_set_state(conn, STATE_HEADER_SENT);
+	}
+
+	return 0;
+}
+
+int connection_send_dynamic(struct connection *conn)
+{
+	/*
+	 * Send the completed buffers in file order. Each buffer sent is handed
+	 * back to the kernel for the next chunk straight away.
+	 */
+	struct aio_buffer *buf;
+	ssize_t bytes_sent;
+
+	while (conn->file_pos < conn->file_end) {
+		buf = &conn->aio_bufs[conn->aio_head];
+		if (conn->aio_used == 0 || !buf->ready) {
+			connection_set_state(conn, STATE_ASYNC_ONGOING);
+			return 0;
+		}
+
+		while (conn->send_pos < buf->len) {
+			bytes_sent = send(conn->sockfd, buf->data + conn->send_pos,
+					  buf->len - conn->send_pos, MSG_NOSIGNAL);
+			if (bytes_sent < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					connection_set_state(conn, STATE_SENDING_DATA);
+					return 0;
+				}
+				dlog(LOG_INFO, "send: %s\n", strerror(errno));
+				return -1;
+			}
+			conn->send_pos += bytes_sent;
+			connection_account_sent(conn, SENT_ASYNC, bytes_sent);
+		}
+
+		conn->file_pos += buf->len;
+		conn->send_pos = 0;
+		buf->ready = 0;
+		conn->aio_head = (conn->aio_head + 1) % AWS_AIO_BUFFERS;
+		conn->aio_used--;
+
+		connection_start_async_io(conn);
+		if (conn->state == STATE_CONNECTION_CLOSED)
+			return -1;
+	}
+
+	connection_finish_range(conn);
+	return 0;
+}
+
+static int connection_send_generated(struct connection *conn)
+{
+	/*
+	 * Send generated pieces of the body until the socket is full, the body
+	 * is over or the budget of the wakeup is spent. The next piece is only
+	 * generated once the previous one is out, so a slow reader holds the
+	 * handler back. Returns -1 on error.
+	 */
+	size_t budget = AWS_SENDFILE_BUDGET;
+	ssize_t bytes_sent;
+
+	while (conn->state == STATE_SENDING_DATA) {
+		while (conn->send_pos < conn->send_len) {
+			bytes_sent = send(conn->sockfd, conn->body + conn->send_pos,
+					  conn->send_len - conn->send_pos, MSG_NOSIGNAL);
+			if (bytes_sent < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 0;
+				dlog(LOG_INFO, "send: %s\n", strerror(errno));
+				return -1;
+			}
+			conn->send_pos += bytes_sent;
+			connection_account_sent(conn, SENT_GENERATED, bytes_sent);
+			budget -= (size_t)bytes_sent < budget ? (size_t)bytes_sent : budget;
+		}
+
+		if (budget == 0) {
+			/* As in connection_send_static(): resume after the others. */
+			if (w_epoll_update_ptr_out_et(conn->worker->epollfd, conn->sockfd, conn) < 0)
+				return -1;
+			return 0;
+		}
+
+		connection_next_chunk(conn);
+	}
+
+	return 0;
+}
+
+int connection_prepare_cached_iov(struct connection *conn)
+{
+	/*
+	 * Lay the cached response out around the Connection header, or a
+	 * generated one after its header, leaving out the send_pos bytes
+	 * already sent. Returns the number of parts.
+	 */
+	struct file_cache_entry *e = conn->file;
+	const struct header_line *line = connection_header_line(conn);
+	struct iovec parts[3];
+	size_t skip = conn->send_pos;
+	int n = 0;
+	int i;
+
+	if (e != NULL) {
+		parts[0] = (struct iovec){ e->response, e->header_len };
+		parts[1] = (struct iovec){ (void *)line->text, line->len };
+		parts[2] = (struct iovec){ e->response + e->header_len,
+					   e->response_len - e->header_len };
+	} else {
+		parts[0] = (struct iovec){ conn->send_buffer, conn->send_len - conn->body_len };
+		parts[1] = (struct iovec){ NULL, 0 };
+		parts[2] = (struct iovec){ (void *)conn->body, conn->body_len };
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (skip >= parts[i].iov_len) {
+			skip -= parts[i].iov_len;
+			continue;
+		}
+		conn->send_iov[n].iov_base = (char *)parts[i].iov_base + skip;
+		conn->send_iov[n].iov_len = parts[i].iov_len - skip;
+		skip = 0;
+		n++;
+	}
+
+	return n;
+}
+
+static int connection_send_cached(struct connection *conn)
+{
+	/* Send a response straight from the file cache, one call per attempt. */
+	struct msghdr msg;
+	ssize_t bytes_sent;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = conn->send_iov;
+
+	while (conn->send_pos < conn->send_len) {
+		msg.msg_iovlen = connection_prepare_cached_iov(conn);
+		bytes_sent = sendmsg(conn->sockfd, &msg, MSG_NOSIGNAL);
+		if (bytes_sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			dlog(LOG_INFO, "sendmsg: %s\n", strerror(errno));
+			return -1;
+		}
+		conn->send_pos += bytes_sent;
+		connection_account_sent(conn, SENT_MEMORY, bytes_sent);
+	}
+
+	return 0;
+}
+
+/* names used in the statistics, by enum connection_state */
+static const char * const connection_state_names[STATE_NO_STATE] = {
+	[STATE_INITIAL] = "idle",
+	[STATE_RECEIVING_DATA] = "receiving",
+	[STATE_REQUEST_RECEIVED] = "request_received",
+	[STATE_SENDING_DATA] = "sending_data",
+	[STATE_SENDING_HEADER] = "sending_header",
+	[STATE_SENDING_404] = "sending_error",
+	[STATE_SENDING_CACHED] = "sending_cached",
+	[STATE_ASYNC_ONGOING] = "async_ongoing",
+	[STATE_DATA_SENT] = "data_sent",
+	[STATE_HEADER_SENT] = "header_sent",
+	[STATE_404_SENT] = "error_sent",
+	[STATE_CONNECTION_CLOSED] = "closed",
+};
+
+static const char * const response_status_names[RESPONSE_STATUS_COUNT] = {
+	"200", "206", "304", "400", "404", "416"
+};
+
+static const char * const sent_from_names[SENT_FROM_COUNT] = {
+	"header", "sendfile", "async", "memory", "generated", "splice"
+};
+
+static size_t stats_append(char *buf, size_t size, size_t len, const char *fmt, ...)
+{
+	/* Append to buf, stopping quietly once it is full. */
+	va_list ap;
+	int n;
+
+	if (len >= size)
+		return len;
+
+	va_start(ap, fmt);
+	n = vsnprintf(buf + len, size - len, fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || (size_t)n >= size - len)
+		return size - 1;
+
+	return len + n;
+}
+
+static size_t stats_append_histogram(char *buf, size_t size, size_t len, const char *name,
+				     const struct stats_histogram *h)
+{
+	static const double quantiles[] = { 50, 90, 99, 99.9 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+		len = stats_append(buf, size, len, "%s{quantile=\"%g\"} %llu\n", name,
+				   quantiles[i] / 100, (unsigned long long)stats_hist_percentile(h, quantiles[i]));
+	len = stats_append(buf, size, len, "%s_max %llu\n%s_count %llu\n",
+			   name, (unsigned long long)h->max, name, (unsigned long long)h->count);
+
+	return len;
+}
+
+static size_t render_stats(char *buf, size_t size)
+{
+	/*
+	 * Sum the statistics of every worker into plain text, in the
+	 * Prometheus exposition format. Other workers go on updating theirs
+	 * meanwhile, so the figures are consistent to within a few events.
+	 */
+	struct stats_histogram ttfb, response_time;
+	uint64_t states[STATE_NO_STATE] = { 0 };
+	uint64_t responses[RESPONSE_STATUS_COUNT] = { 0 };
+	uint64_t bytes[SENT_FROM_COUNT] = { 0 };
+	uint64_t accepted = 0, requests = 0, active = 0;
+	uint64_t aio_in_flight = 0, aio_in_flight_max = 0;
+	uint64_t cache_hits = 0, cache_misses = 0, cache_evictions = 0;
+	struct worker_stats *ws;
+	size_t len = 0;
+	int i, j;
+
+	memset(&ttfb, 0, sizeof(ttfb));
+	memset(&response_time, 0, sizeof(response_time));
+
+	for (i = 0; i < num_workers; i++) {
+		ws = &workers[i].stats;
+		accepted += STATS_READ(ws->accepted);
+		requests += STATS_READ(ws->requests);
+		for (j = 0; j < STATE_NO_STATE; j++)
+			states[j] += STATS_READ(ws->states[j]);
+		for (j = 0; j < RESPONSE_STATUS_COUNT; j++)
+			responses[j] += STATS_READ(ws->responses[j]);
+		for (j = 0; j < SENT_FROM_COUNT; j++)
+			bytes[j] += STATS_READ(ws->bytes[j]);
+		aio_in_flight += STATS_READ(ws->aio_in_flight);
+		if (STATS_READ(ws->aio_in_flight_max) > aio_in_flight_max)
+			aio_in_flight_max = STATS_READ(ws->aio_in_flight_max);
+		cache_hits += STATS_READ(ws->cache_hits);
+		cache_misses += STATS_READ(ws->cache_misses);
+		cache_evictions += STATS_READ(ws->cache_evictions);
+		stats_hist_merge(&ttfb, &ws->ttfb);
+		stats_hist_merge(&response_time, &ws->response_time);
+	}
+	for (j = 0; j < STATE_NO_STATE; j++)
+		active += states[j];
+
+	len = stats_append(buf, size, len, "uptime_seconds %llu\nworkers %d\nengine %s\n",
+			   (unsigned long long)((stats_now_us() - start_time_us) / 1000000),
+			   num_workers, use_uring ? "io_uring" : "epoll");
+	len = stats_append(buf, size, len, "connections_accepted_total %llu\nconnections_active %llu\n",
+			   (unsigned long long)accepted, (unsigned long long)active);
+	for (j = 0; j < STATE_NO_STATE; j++)
+		len = stats_append(buf, size, len, "connections{state=\"%s\"} %llu\n",
+				   connection_state_names[j], (unsigned long long)states[j]);
+	len = stats_append(buf, size, len, "requests_total %llu\n", (unsigned long long)requests);
+	for (j = 0; j < RESPONSE_STATUS_COUNT; j++)
+		len = stats_append(buf, size, len, "responses_total{status=\"%s\"} %llu\n",
+				   response_status_names[j], (unsigned long long)responses[j]);
+	for (j = 0; j < SENT_FROM_COUNT; j++)
+		len = stats_append(buf, size, len, "bytes_sent_total{from=\"%s\"} %llu\n",
+				   sent_from_names[j], (unsigned long long)bytes[j]);
+	len = stats_append(buf, size, len, "aio_in_flight %llu\naio_in_flight_max %llu\n",
+			   (unsigned long long)aio_in_flight, (unsigned long long)aio_in_flight_max);
+	len = stats_append(buf, size, len,
+			   "response_cache_hits_total %llu\n"
+			   "response_cache_misses_total %llu\n"
+			   "response_cache_evictions_total %llu\n",
+			   (unsigned long long)cache_hits, (unsigned long long)cache_misses,
+			   (unsigned long long)cache_evictions);
+	len = stats_append_histogram(buf, size, len, "ttfb_us", &ttfb);
+	len = stats_append_histogram(buf, size, len, "response_us", &response_time);
+
+	for (i = 0; i < num_workers; i++) {
+		ws = &workers[i].stats;
+		len = stats_append(buf, size, len, "worker_requests_total{worker=\"%d\"} %llu\n",
+				   i, (unsigned long long)STATS_READ(ws->requests));
+	}
+
+	return len;
+}
+
+static void connection_prepare_send_stats(struct connection *conn)
+{
+	/*
+	 * Render the statistics into a borrowed AIO buffer and send them like
+	 * a response from the file cache.
+	 */
+	connection_get_aio_buffers(conn);
+	conn->body = conn->aio_bufs[0].data;
+	conn->body_len = render_stats(conn->aio_bufs[0].data, sizeof(conn->aio_bufs[0].data));
+
+	STATS_INC(conn->worker->stats.responses[RESPONSE_200]);
+	reply_start(conn);
+	reply_put_literal(conn,
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: ");
+	reply_put_number(conn, conn->body_len);
+	reply_put_literal(conn, "\r\nCache-Control: no-store\r\n");
+	reply_put_line(conn, connection_header_line(conn));
+
+	conn->send_len += conn->body_len;
+}
+
+static void connection_pick_response(struct connection *conn)
+{
+	/* Pick the reply for a fully received request. */
+	int rc;
+
+	conn->request_time = stats_now_us();
+	STATS_INC(conn->worker->stats.requests);
+
+	if (conn->bad_request) {
+		static const struct header_line status = HEADER_LINE("400 Bad Request");
+
+		dlog(LOG_INFO, "Malformed request\n");
+		STATS_INC(conn->worker->stats.responses[RESPONSE_400]);
+		conn->keep_alive = 0;
+		connection_prepare_send_error(conn, &status);
+		connection_set_state(conn, STATE_SENDING_404);
+		return;
+	}
+	dlog(LOG_INFO, "filename: %s\n", conn->filename);
+
+	if (conn->filename_len == sizeof(AWS_DOCUMENT_ROOT AWS_STATS_PATH) - 1 &&
+	    memcmp(conn->filename, AWS_DOCUMENT_ROOT AWS_STATS_PATH, conn->filename_len) == 0) {
+		connection_prepare_send_stats(conn);
+		connection_set_state(conn, STATE_SENDING_CACHED);
+		return;
+	}
+
+	conn->handler = handler_find(conn->filename + sizeof(AWS_DOCUMENT_ROOT) - 1,
+				     conn->filename_len - (sizeof(AWS_DOCUMENT_ROOT) - 1));
+	if (conn->handler != NULL) {
+		connection_prepare_send_generated(conn);
+		return;
+	}
+
+	conn->res_type = connection_get_resource_type(conn);
+	if (conn->res_type == RESOURCE_TYPE_NONE || connection_open_file(conn) < 0) {
+		dlog(LOG_INFO, "Failed to open file %s\n", conn->filename);
+		connection_prepare_send_404(conn);
+		connection_set_state(conn, STATE_SENDING_404);
+		return;
+	}
+
+	if (conn->file->encodings != 0)
+		connection_open_variant(conn);
+
+	if (connection_not_modified(conn)) {
+		connection_prepare_send_304(conn);
+		connection_set_state(conn, STATE_SENDING_404);
+		return;
+	}
+
+	if (conn->headers[REQUEST_HEADER_RANGE].len > 0) {
+		rc = connection_parse_range(conn);
+		if (rc == 0) {
+			connection_prepare_send_416(conn);
+			connection_set_state(conn, STATE_SENDING_404);
+			return;
+		}
+		if (rc > 0) {
+			conn->range_count = rc;
+			connection_prepare_send_partial(conn);
+			connection_set_state(conn, STATE_SENDING_HEADER);
+			return;
+		}
+	}
+
+	/* The in-memory response of a variant lacks its Content-Encoding. */
+	if (conn->file->response != NULL && conn->encoding < 0) {
+		STATS_INC(conn->worker->stats.responses[RESPONSE_200]);
+		STATS_INC(conn->worker->stats.cache_hits);
+		conn->send_pos = 0;
+		conn->send_len = conn->file->response_len + connection_header_line(conn)->len;
+		connection_set_state(conn, STATE_SENDING_CACHED);
+		return;
+	}
+
+	connection_prepare_send_reply_header(conn);
+	connection_set_state(conn, STATE_SENDING_HEADER);
+}
+
+void connection_prepare_response(struct connection *conn)
+{
+	/*
+	 * Pick the reply, and have the first reads of a dynamic file queued
+	 * along with it: they go to the disk at the end of this batch of
+	 * events, while the socket is still being waited on, instead of after
+	 * the first EPOLLOUT. io_uring reads on its own schedule.
+	 */
+	connection_pick_response(conn);
+
+	if (!use_uring && !use_splice && conn->res_type == RESOURCE_TYPE_DYNAMIC &&
+	    conn->state == STATE_SENDING_HEADER && conn->file_pos < conn->file_end)
+		connection_start_async_io(conn);
+}
+
+void handle_input(struct connection *conn)
+{
+	int rc;
+
+	receive_data(conn);
+
+	if (conn->state == STATE_CONNECTION_CLOSED) {
+		connection_remove(conn);
+		return;
+	}
+
+	/* Wait for the rest of the request. */
+	if (conn->state != STATE_REQUEST_RECEIVED)
+		return;
+
+	connection_prepare_response(conn);
+
+	rc = w_epoll_update_ptr_out_et(conn->worker->epollfd, conn->sockfd, conn);
+	DIE(rc < 0, "w_epoll_update_ptr_out_et");
+}
+
+void handle_output(struct connection *conn)
+{
+	/*
+	 * Advance the connection as far as the socket allows. Each state either
+	 * completes and moves on, or returns to wait for the next EPOLLOUT.
+	 */
+	while (1) {
+		switch (conn->state) {
+		case STATE_SENDING_HEADER:
+			if (conn->res_type == RESOURCE_TYPE_DYNAMIC && !use_splice &&
+			    conn->file_pos < conn->file_end) {
+				if (connection_send_header_dynamic(conn) < 0) {
+					connection_set_state(conn, STATE_CONNECTION_CLOSED);
+					break;
+				}
+				if (conn->state == STATE_SENDING_HEADER)
+					return;
+				break;
+			}
+			/* fall through */
+		case STATE_SENDING_404:
+			if (connection_send_data(conn) < 0) {
+				connection_set_state(conn, STATE_CONNECTION_CLOSED);
+				break;
+			}
+			if (conn->send_pos < conn->send_len)
+				return;
+			dlog(LOG_INFO, "Sent header: %s\n", conn->send_buffer);
+			connection_set_state(conn, (conn->state == STATE_SENDING_404) ?
+					STATE_404_SENT : STATE_HEADER_SENT);
+			break;
+
+		case STATE_SENDING_CACHED:
+			if (connection_send_cached(conn) < 0) {
+				connection_set_state(conn, STATE_CONNECTION_CLOSED);
+				break;
+			}
+			if (conn->send_pos < conn->send_len)
+				return;
+			connection_set_state(conn, STATE_DATA_SENT);
+			break;
+
+		case STATE_HEADER_SENT:
+			if (conn->res_type == RESOURCE_TYPE_HANDLER) {
+				connection_next_chunk(conn);
+			} else if (conn->file_pos == conn->file_end) {
+				/* empty file, or the closing boundary of a multipart reply */
+				connection_set_state(conn, STATE_DATA_SENT);
+			} else if (conn->res_type == RESOURCE_TYPE_STATIC || use_splice) {
+				conn->send_pos = 0;
+				connection_set_state(conn, STATE_SENDING_DATA);
+			} else {
+				/* Reads are under way; the first chunk went out in part. */
+				connection_set_state(conn, STATE_ASYNC_ONGOING);
+			}
+			break;
+
+		case STATE_SENDING_DATA:
+			if (conn->res_type == RESOURCE_TYPE_HANDLER) {
+				if (connection_send_generated(conn) < 0) {
+					connection_set_state(conn, STATE_CONNECTION_CLOSED);
+					break;
+				}
+				if (conn->state == STATE_SENDING_DATA)
+					return;
+				break;
+			}
+			if (conn->res_type == RESOURCE_TYPE_STATIC) {
+				connection_set_state(conn, connection_send_static(conn));
+				if (conn->state == STATE_SENDING_DATA)
+					return;
+				break;
+			}
+			if (use_splice) {
+				connection_set_state(conn, connection_send_splice(conn));
+				if (conn->state == STATE_SENDING_DATA)
+					return;
+				break;
+			}
+			/* fall through */
+		case STATE_ASYNC_ONGOING:
+			/* Send whatever reads have completed, in file order. */
+			if (connection_send_dynamic(conn) < 0) {
+				connection_set_state(conn, STATE_CONNECTION_CLOSED);
+				break;
+			}
+			if (conn->state == STATE_SENDING_DATA || conn->state == STATE_ASYNC_ONGOING)
+				return;
+			break;
+
+		case STATE_DATA_SENT:
+		case STATE_404_SENT:
+			connection_account_done(conn);
+			if (!conn->keep_alive) {
+				connection_remove(conn);
+				return;
+			}
+
+			/* Serve a pipelined request right away, else wait for one. */
+			connection_reset_request(conn);
+			if (conn->state == STATE_REQUEST_RECEIVED) {
+				connection_prepare_response(conn);
+				break;
+			}
+			if (w_epoll_update_ptr_in_et(conn->worker->epollfd, conn->sockfd, conn) < 0) {
+				connection_set_state(conn, STATE_CONNECTION_CLOSED);
+				break;
+			}
+			return;
+
+		case STATE_CONNECTION_CLOSED:
+			connection_remove(conn);
+			return;
+
+		default:
+			return;
+		}
+	}
+}
+
+void handle_client(uint32_t event, struct connection *conn)
+{
+	/* Removed while handling an earlier event of the same batch. */
+	if (conn->sockfd < 0)
+		return;
+
+	/*
+	 * A socket in error or hung up on both sides has nothing left to
+	 * receive or deliver: drop it now, even while it only waits for its
+	 * AIO reads, rather than at the next completion.
+	 */
+	if (event & (EPOLLERR | EPOLLHUP)) {
+		dlog(LOG_INFO, "Connection error or hang-up\n");
+		connection_remove(conn);
+		return;
+	}
+
+	/* Handle new client. There can be input and output connections.
+	 * Otherwise the connection state, not the event mask, tells which side
+	 * is next.
+	 */
+	if (conn->state == STATE_INITIAL || conn->state == STATE_RECEIVING_DATA)
+		handle_input(conn);
+	else
+		handle_output(conn);
+
+	if (conn->sockfd >= 0)
+		connection_update_timer(conn);
+}
+
+static void worker_free_closed(struct worker *w)
+{
+	struct connection *conn;
+
+	while (w->closed != NULL) {
+		conn = w->closed;
+		w->closed = conn->next_closed;
+		connection_free(conn);
+	}
+}
+
+static void worker_submit_aio(struct worker *w)
+{
+	/*
+	 * Hand the reads queued by all connections during this batch of events
+	 * to the kernel in as few io_submit(2) calls as possible. Reads the
+	 * context has no room for stay queued until completions free it up.
+	 */
+	struct iocb *piocb[AWS_EPOLL_BATCH];
+	struct aio_buffer *buf;
+	struct connection *conn;
+	int n;
+	int rc;
+
+	while (w->aio_pending_head != NULL) {
+		n = 0;
+		for (buf = w->aio_pending_head; buf != NULL && n < AWS_EPOLL_BATCH; buf = buf->next_pending)
+			piocb[n++] = &buf->iocb;
+
+		rc = io_submit(w->ctx, n, piocb);
+		if (rc == -EAGAIN)
+			return;
+		if (rc == 0)
+			rc = -EAGAIN;
+
+		if (rc < 0) {
+			/* The first read was refused; fail its connection. */
+			buf = w->aio_pending_head;
+			w->aio_pending_head = buf->next_pending;
+			if (w->aio_pending_head == NULL)
+				w->aio_pending_tail = NULL;
+
+			conn = buf->iocb.data;
+			conn->aio_outstanding--;
+			if (conn->sockfd < 0) {
+				if (conn->aio_outstanding == 0)
+					connection_release(conn);
+				continue;
+			}
+
+			dlog(LOG_ERR, "io_submit: %s\n", strerror(-rc));
+			connection_set_state(conn, STATE_CONNECTION_CLOSED);
+			handle_output(conn);
+			continue;
+		}
+
+		w->aio_in_flight += rc;
+		if (w->aio_in_flight > w->stats.aio_in_flight_max)
+			STATS_SET(w->stats.aio_in_flight_max, w->aio_in_flight);
+		while (rc-- > 0) {
+			w->aio_pending_head = w->aio_pending_head->next_pending;
+			if (w->aio_pending_head == NULL)
+				w->aio_pending_tail = NULL;
+		}
+	}
+}
+
+static void worker_complete_aio(struct worker *w)
+{
+	/* Demultiplex finished reads back to the connections that issued them. */
+	struct io_event events[AWS_EPOLL_BATCH];
+	struct timespec no_wait = { 0, 0 };
+	struct connection *conn;
+	uint64_t completed;
+	int rc;
+	int i;
+
+	if (read(w->aio_eventfd, &completed, sizeof(completed)) < 0)
+		return;
+
+	do {
+		rc = io_getevents(w->ctx, 0, AWS_EPOLL_BATCH, events, &no_wait);
+		if (rc < 0)
+			return;
+
+		w->aio_in_flight -= rc;
+		for (i = 0; i < rc; i++) {
+			conn = events[i].data;
+			connection_complete_async_io(conn, &events[i]);
+			if (conn->sockfd >= 0)
+				connection_update_timer(conn);
+		}
+	} while (rc == AWS_EPOLL_BATCH);
+}
+
+static void worker_init(struct worker *w, int id)
+{
+	int rc;
+
+	w->id = id;
+	w->closed = NULL;
+	w->splice_pipe[0] = -1;
+	w->splice_pipe[1] = -1;
+	file_cache_init(&w->files, response_cache_max);
+	timer_wheel_init(&w->timers, worker_now_tick());
+
+	rc = pool_init(&w->conn_pool, sizeof(struct connection), AWS_CONN_PREALLOC);
+	DIE(rc < 0, "pool_init");
+	rc = pool_init(&w->recv_pool, AWS_RECV_BUFFER_SIZE, AWS_RECV_PREALLOC);
+	DIE(rc < 0, "pool_init");
+	rc = pool_init(&w->name_pool, AWS_NAME_MAX, AWS_NAME_PREALLOC);
+	DIE(rc < 0, "pool_init");
+	rc = pool_init(&w->aio_pool, AWS_AIO_BUFFERS * sizeof(struct aio_buffer), AWS_AIO_PREALLOC);
+	DIE(rc < 0, "pool_init");
+
+	if (use_uring) {
+		/* The ring replaces epoll and libaio altogether. */
+		w->listenfd = tcp_create_listener(AWS_LISTEN_PORT, AWS_LISTEN_BACKLOG);
+		worker_uring_init(w);
+		return;
+	}
+
+	/* Initialize asynchronous operations. */
+	w->ctx = 0;
+	rc = io_setup(AWS_AIO_QUEUE_DEPTH, &w->ctx);
+	DIE(rc < 0, "io_setup");
+
+	w->aio_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	DIE(w->aio_eventfd < 0, "eventfd");
+	w->aio_pending_head = NULL;
+	w->aio_pending_tail = NULL;
+	w->aio_in_flight = 0;
+
+	/* Initialize multiplexing. */
+	w->epollfd = w_epoll_create();
+	DIE(w->epollfd < 0, "w_epoll_create");
+
+	/* Create server socket; SO_REUSEPORT lets every worker bind the port. */
+	w->listenfd = tcp_create_listener(AWS_LISTEN_PORT, AWS_LISTEN_BACKLOG);
+
+	/* The accept loop stops on EAGAIN. */
+	rc = fcntl(w->listenfd, F_SETFL, fcntl(w->listenfd, F_GETFL, 0) | O_NONBLOCK);
+	DIE(rc < 0, "fcntl");
+
+	rc = w_epoll_add_fd_in(w->epollfd, w->listenfd);
+	DIE(rc < 0, "w_epoll_add_fd_in");
+
+	rc = w_epoll_add_fd_in(w->epollfd, w->aio_eventfd);
+	DIE(rc < 0, "w_epoll_add_fd_in");
+}
+
+static void *worker_loop(void *arg)
+{
+	struct worker *w = arg;
+	int timeout;
+	int rc;
+
+	/* worker main loop */
+	while (1) {
+		struct epoll_event revs[AWS_EPOLL_BATCH];
+		int i;
+
+		/*
+		 * Wait for events; collect every ready descriptor in one call.
+		 * Wake up for the next timer tick while connections have
+		 * deadlines. Reads left queued with nothing in flight will not
+		 * signal the eventfd, so poll for room to submit them instead.
+		 */
+		timeout = worker_timer_timeout(w);
+		if (w->aio_pending_head != NULL && w->aio_in_flight == 0)
+			timeout = 1;
+		rc = w_epoll_wait_batch(w->epollfd, revs, AWS_EPOLL_BATCH, timeout);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		DIE(rc < 0, "w_epoll_wait_batch");
+
+		/* Switch event types; consider
+		 *   - new connection requests (on server socket)
+		 *   - completed asynchronous reads (on the worker's eventfd)
+		 *   - socket communication (on connection sockets)
+		 */
+		for (i = 0; i < rc; i++) {
+			if (revs[i].data.fd == w->listenfd) {
+				if (revs[i].events & EPOLLIN)
+					handle_new_connection(w);
+			} else if (revs[i].data.fd == w->aio_eventfd) {
+				worker_complete_aio(w);
+			} else {
+				handle_client(revs[i].events, revs[i].data.ptr);
+			}
+		}
+
+		worker_expire_timers(w);
+		worker_submit_aio(w);
+		worker_free_closed(w);
+		worker_publish_stats(w);
+	}
+
+	return NULL;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-w workers] [-e epoll|uring] [-c bytes] [-d aio|splice] [-g]\n"
+		"  -w N  number of event loop threads (0 = one per CPU, default %d)\n"
+		"  -e E  I/O engine: epoll with libaio (default) or io_uring\n"
+		"  -c N  serve files up to N bytes from memory (0 = never, default %d)\n"
+		"  -d D  send dynamic files from AIO buffers (default) or with splice(2);\n"
+		"        the io_uring engine always reads them into its buffers\n"
+		"  -g    serve the demo generated bodies /stream/bytes/<n> and\n"
+		"        /stream/lines/<n>\n",
+		argv0, AWS_DEFAULT_WORKERS, FILE_CACHE_RESPONSE_MAX);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	void *(*loop)(void *);
+	int opt;
+	int rc;
+	int i;
+
+	while ((opt = getopt(argc, argv, "w:e:c:d:g")) != -1) {
+		switch (opt) {
+		case 'w':
+			num_workers = atoi(optarg);
+			if (num_workers == 0)
+				num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+			if (num_workers < 1)
+				usage(argv[0]);
+			if (num_workers > AWS_MAX_WORKERS)
+				num_workers = AWS_MAX_WORKERS;
+			break;
+		case 'e':
+			if (strcmp(optarg, "uring") == 0)
+				use_uring = 1;
+			else if (strcmp(optarg, "epoll") == 0)
+				use_uring = 0;
+			else
+				usage(argv[0]);
+			break;
+		case 'c':
+			response_cache_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			if (strcmp(optarg, "splice") == 0)
+				use_splice = 1;
+			else if (strcmp(optarg, "aio") == 0)
+				use_splice = 0;
+			else
+				usage(argv[0]);
+			break;
+		case 'g':
+			use_demo_handlers = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (use_uring)
+		use_splice = 0;
+	if (use_demo_handlers)
+		handler_register_demos();
+
+	start_time_us = stats_now_us();
+
+	/* A client closing early must not kill the server. */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < num_workers; i++)
+		worker_init(&workers[i], i);
+
+	/* Uncomment the following line for debugging. */
+	dlog(LOG_INFO, "Server waiting for connections on port %d with %d %s worker(s)\n",
+	     AWS_LISTEN_PORT, num_workers, use_uring ? "io_uring" : "epoll");
+
+	/* The main thread runs the first event loop itself. */
+	loop = use_uring ? worker_uring_loop : worker_loop;
+	for (i = 1; i < num_workers; i++) {
+		rc = pthread_create(&workers[i].thread, NULL, loop, &workers[i]);
+		DIE(rc != 0, "pthread_create");
 	}
+	workers[0].thread = pthread_self();
+	loop(&workers[0]);
 
 	return 0;
 }
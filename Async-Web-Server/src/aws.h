@@ -3,19 +3,101 @@
 #ifndef AWS_H_
 #define AWS_H_		1
 
+#include <pthread.h>
+#include <libaio.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
 #include "http-parser/http_parser.h"
+#include "file_cache.h"
+#include "handler.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "utils/pool.h"
+#include "utils/w_uring.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 #define AWS_LISTEN_PORT		8888
+/* pending connections the kernel queues between two accept loops */
+#define AWS_LISTEN_BACKLOG	4096
 #define AWS_DOCUMENT_ROOT	"./"
 #define AWS_REL_STATIC_FOLDER	"static/"
 #define AWS_REL_DYNAMIC_FOLDER	"dynamic/"
 #define AWS_ABS_STATIC_FOLDER	(AWS_DOCUMENT_ROOT AWS_REL_STATIC_FOLDER)
 #define AWS_ABS_DYNAMIC_FOLDER	(AWS_DOCUMENT_ROOT AWS_REL_DYNAMIC_FOLDER)
 
+/* maximum number of events collected by one epoll_wait(2) call */
+#define AWS_EPOLL_BATCH		256
+
+/* reads kept in flight per connection while serving a dynamic file */
+#define AWS_AIO_BUFFERS		4
+#define AWS_AIO_BUF_SIZE	BUFSIZ
+
+/*
+ * Per connection buffers. Receive buffers, AIO buffers and long file names
+ * are borrowed from the worker only while in use, so an idle keep-alive
+ * connection holds none; the reply header and short names are kept inline.
+ */
+#define AWS_RECV_BUFFER_SIZE	BUFSIZ
+#define AWS_SEND_BUFFER_SIZE	512
+#define AWS_NAME_INLINE		64
+#define AWS_NAME_MAX		BUFSIZ
+
+/* request headers looked at; the server ignores any past the first ones */
+#define AWS_REQUEST_HEADERS_MAX	32
+
+/* byte ranges served from one request; more and the Range header is ignored */
+#define AWS_MAX_RANGES		8
+#define AWS_RANGE_BOUNDARY	"aws-byteranges-7d1f3c2b"
+
+/* connections and buffers preallocated by each worker */
+#define AWS_CONN_PREALLOC	1024
+#define AWS_RECV_PREALLOC	64
+#define AWS_NAME_PREALLOC	16
+#define AWS_AIO_PREALLOC	16
+
+/*
+ * bytes a static transfer or a generated body may push per wakeup before
+ * yielding the loop to other connections
+ */
+#define AWS_SENDFILE_BUDGET	(256 * 1024)
+
+/* bytes spliced into a pipe at once: what a pipe holds by default */
+#define AWS_SPLICE_PIPE_SIZE	(64 * 1024)
+
+/* depth of the AIO context shared by all connections of a worker */
+#define AWS_AIO_QUEUE_DEPTH	4096
+
+/*
+ * io_uring engine: submission queue depth, registered read buffers shared
+ * by the connections of a worker, and registered file slots (indexed by
+ * socket descriptor) for connection sockets.
+ */
+#define AWS_URING_ENTRIES	4096
+#define AWS_URING_BUFFERS	64
+#define AWS_URING_BUF_SIZE	65536
+#define AWS_URING_FILES		4096
+
+/*
+ * Connection timeouts, in seconds: waiting for a request on an idle
+ * connection, receiving a whole request from its first byte, and sending
+ * without any progress. They are checked on every timer wheel tick.
+ */
+#define AWS_IDLE_TIMEOUT	15
+#define AWS_REQUEST_TIMEOUT	10
+#define AWS_SEND_TIMEOUT	30
+#define AWS_TIMER_TICK_MS	250
+
+/* reserved request path answered with the server's statistics */
+#define AWS_STATS_PATH		"__stats"
+
+/* event loop threads; 0 on the command line means one per online CPU */
+#define AWS_DEFAULT_WORKERS	1
+#define AWS_MAX_WORKERS		64
+
 enum connection_state {
 	STATE_INITIAL,
 	STATE_RECEIVING_DATA,
@@ -23,6 +105,7 @@ enum connection_state {
 	STATE_SENDING_DATA,
 	STATE_SENDING_HEADER,
 	STATE_SENDING_404,
+	STATE_SENDING_CACHED,
 	STATE_ASYNC_ONGOING,
 	STATE_DATA_SENT,
 	STATE_HEADER_SENT,
@@ -32,70 +115,339 @@ enum connection_state {
 };
 
 #define OUT_STATE(s) (((s) == STATE_SENDING_DATA) ||	\
-	((s) == STATE_SENDING_HEADER) || ((s) == STATE_SENDING_404))
+	((s) == STATE_SENDING_HEADER) || ((s) == STATE_SENDING_404) ||	\
+	((s) == STATE_SENDING_CACHED))
+
+/* Deadline a connection is currently held to */
+enum connection_timer {
+	TIMER_NONE,
+	TIMER_IDLE,
+	TIMER_REQUEST,
+	TIMER_SEND
+};
 
-/* Resource type request by HTTP (either static or dynamic) */
+/* Request headers the server acts on */
+enum request_header {
+	REQUEST_HEADER_RANGE,
+	REQUEST_HEADER_IF_NONE_MATCH,
+	REQUEST_HEADER_IF_MODIFIED_SINCE,
+	REQUEST_HEADER_ACCEPT_ENCODING,
+	REQUEST_HEADER_COUNT
+};
+
+/* Extent of a header's value in the receive buffer; len is 0 if absent */
+struct header_value {
+	size_t off;
+	size_t len;
+};
+
+/* Responses counted by status */
+enum response_status {
+	RESPONSE_200,
+	RESPONSE_206,
+	RESPONSE_304,
+	RESPONSE_400,
+	RESPONSE_404,
+	RESPONSE_416,
+	RESPONSE_STATUS_COUNT
+};
+
+/* Where the bytes sent to clients come from */
+enum sent_from {
+	SENT_HEADER,
+	SENT_SENDFILE,
+	SENT_ASYNC,
+	SENT_MEMORY,
+	SENT_GENERATED,
+	SENT_SPLICE,
+	SENT_FROM_COUNT
+};
+
+/*
+ * Statistics of a worker, updated by its own thread only (see stats.h).
+ * Connections by state move on every transition in connection_set_state(),
+ * from connection_create() to connection_free(); only the AIO queue depth
+ * and the file cache figures are copied in once per timer tick.
+ */
+struct worker_stats {
+	uint64_t accepted;
+	uint64_t requests;
+	uint64_t responses[RESPONSE_STATUS_COUNT];
+	uint64_t bytes[SENT_FROM_COUNT];
+	/* connections from creation until freed, by state */
+	uint64_t states[STATE_NO_STATE];
+	uint64_t aio_in_flight;
+	uint64_t aio_in_flight_max;
+	/* in-memory responses sent, and the file cache's misses and evictions */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	uint64_t cache_evictions;
+
+	/* from a complete request to its first response byte, and last one */
+	struct stats_histogram ttfb;
+	struct stats_histogram response_time;
+};
+
+/* Resource type request by HTTP (static or dynamic file, or a handler) */
 enum resource_type {
 	RESOURCE_TYPE_NONE,
 	RESOURCE_TYPE_STATIC,
-	RESOURCE_TYPE_DYNAMIC
+	RESOURCE_TYPE_DYNAMIC,
+	RESOURCE_TYPE_HANDLER
+};
+
+/*
+ * Event loop owned by a single thread. Workers share nothing: each one has
+ * its own SO_REUSEPORT listener, epoll instance and AIO context, and the
+ * kernel spreads incoming connections across the listeners.
+ */
+struct worker {
+	int id;
+	pthread_t thread;
+
+	int listenfd;
+	int epollfd;
+
+	/*
+	 * One AIO context serves every connection of the worker. Reads queued
+	 * while handling a batch of events are submitted together, and all
+	 * completions are signalled through a single eventfd.
+	 */
+	io_context_t ctx;
+	int aio_eventfd;
+	struct aio_buffer *aio_pending_head;
+	struct aio_buffer *aio_pending_tail;
+	unsigned int aio_in_flight;
+
+	/*
+	 * Empty pipe lent to a connection for moving a dynamic file with
+	 * splice(2), or -1 while one is being refilled elsewhere.
+	 */
+	int splice_pipe[2];
+
+	/* connections removed during the current batch of events */
+	struct connection *closed;
+
+	/* connection timeouts */
+	struct timer_wheel timers;
+
+	/* free connections, receive buffers, AIO buffer rings and long names */
+	struct pool conn_pool;
+	struct pool recv_pool;
+	struct pool aio_pool;
+	struct pool name_pool;
+
+	/* open files shared by the worker's connections */
+	struct file_cache files;
+
+	struct worker_stats stats;
+	unsigned long stats_tick;
+
+	/* io_uring engine state, unused by the epoll loop */
+	struct w_uring ring;
+	char *uring_bufs;
+	int uring_free[AWS_URING_BUFFERS];
+	int uring_nfree;
+	int uring_files;
+	struct sockaddr_in accept_addr;
+	socklen_t accept_addrlen;
+	struct __kernel_timespec uring_tick;
+	int uring_tick_armed;
+};
+
+/*
+ * Buffer filled by one asynchronous read. The iocb comes first so that the
+ * buffer can be recovered from a completion's io_event.obj; iocb.data
+ * points to the owning connection.
+ */
+struct aio_buffer {
+	struct iocb iocb;
+	size_t len;
+	int ready;
+	/* link in the worker's queue of reads waiting for io_submit(2) */
+	struct aio_buffer *next_pending;
+	char data[AWS_AIO_BUF_SIZE];
+};
+
+/* Inclusive byte range of the file requested through a Range header */
+struct byte_range {
+	off_t start;
+	off_t end;
 };
 
 /* Structure acting as a connection handler */
 struct connection {
-    /* file to be sent */
+	/* worker whose event loop owns the connection */
+	struct worker *worker;
+
+    /* file to be sent; fd belongs to the worker's file cache entry */
 	int fd;
-	char filename[BUFSIZ];
+	struct file_cache_entry *file;
 
-    /* asynchronous notification */
-	int eventfd;
-	int sockfd;
+	/*
+	 * Path of the file, built from the request path once the headers are
+	 * in. It points to filename_inline unless it outgrew it, and then to a
+	 * buffer of AWS_NAME_MAX bytes borrowed from the worker.
+	 */
+	char *filename;
+	size_t filename_len;
+	size_t filename_size;
+	char filename_inline[AWS_NAME_INLINE];
+	/* the path has a ".." in it */
+	int dot_dot;
 
-	io_context_t ctx;
-	struct iocb iocb;
-	struct iocb *piocb[1];
+	int sockfd;
 	size_t file_size;
+	/* end of the part of the file being sent: file_size or a range's end */
+	size_t file_end;
+
+	/*
+	 * Precompressed variant being sent (an enum file_encoding, or -1 for
+	 * the file itself); vary is set when the file has any variant.
+	 */
+	int encoding;
+	int vary;
+
+	/* ranges served as a 206 reply; range_index is the one being sent */
+	struct byte_range ranges[AWS_MAX_RANGES];
+	unsigned int range_count;
+	unsigned int range_index;
+
+	/*
+	 * Ring of read buffers for dynamic files, borrowed for the transfer:
+	 * aio_head is the next buffer to send, aio_tail the next one to fill
+	 * and aio_used counts buffers that are in flight or waiting to be sent.
+	 */
+	struct aio_buffer *aio_bufs;
+	unsigned int aio_head;
+	unsigned int aio_tail;
+	unsigned int aio_used;
+	size_t aio_offset;
+	/* reads queued or in flight; the connection outlives all of them */
+	unsigned int aio_outstanding;
 
-	/* buffers used for receiving messages */
-	char recv_buffer[BUFSIZ];
+	/*
+	 * Pipe a dynamic file is spliced through, and the bytes in it that the
+	 * socket has yet to take. It is the worker's, kept only while not empty.
+	 */
+	int pipefd[2];
+	size_t pipe_len;
+
+	/* received bytes; borrowed while a request is pending */
+	char *recv_buffer;
 	size_t recv_len;
 
 	/* Used for sending data (headers, 404 or data populated through async IO). */
-	char send_buffer[BUFSIZ];
+	char send_buffer[AWS_SEND_BUFFER_SIZE];
 	size_t send_len;
 	size_t send_pos;
 	size_t file_pos;
-	size_t async_read_len;
 
-	/* HTTP request path */
-	int have_path;
-	char request_path[BUFSIZ];
+	/*
+	 * Unsent parts of a response sent from memory: one from the file
+	 * cache, or, when file is NULL, the header in send_buffer followed by
+	 * body.
+	 */
+	struct iovec send_iov[3];
+	const char *body;
+	size_t body_len;
+
+	/*
+	 * Handler generating the body and its state. Each piece is generated
+	 * into aio_bufs[0] and sent from body, framed as a chunk for HTTP/1.1
+	 * clients; HTTP/1.0 ones get it unframed, up to the connection close.
+	 */
+	const struct handler *handler;
+	uint64_t handler_state[HANDLER_STATE_SIZE / sizeof(uint64_t)];
+	int chunked;
+	int body_done;
+
+	/* when the request was complete, and whether a reply byte went out */
+	uint64_t request_time;
+	int first_byte_sent;
+
 	enum resource_type res_type;
 	enum connection_state state;
 
+	/*
+	 * The request line and headers are read where they lie in recv_buffer,
+	 * which keeps the request until its response is done: the parser
+	 * records their offsets in request_spans, and the values of the
+	 * headers the server acts on are picked out once all are in.
+	 */
+	http_parser_spans request_spans;
+	http_parser_header request_headers[AWS_REQUEST_HEADERS_MAX];
+	struct header_value headers[REQUEST_HEADER_COUNT];
+
+	/* persistent connection handling */
+	int keep_alive;
+	int bad_request;
+	/* bytes of recv_buffer already fed to the parser for this request */
+	size_t request_len;
+
 	/* HTTP_REQUEST parser */
 	http_parser request_parser;
+
+	/* link in the owning worker's list of removed connections */
+	struct connection *next_closed;
+
+	/* expiry of the current idle, request or send deadline */
+	struct timer timer;
+	enum connection_timer timer_kind;
+
+	/*
+	 * io_uring engine: registered file slot of the socket (-1 if none) and
+	 * the buffer file chunks are read into (io_buf_index is -1 when it is
+	 * not a registered one). uring_readable is set when a poll found the
+	 * socket readable, so the next recv is queued with a buffer.
+	 */
+	int file_slot;
+	char *io_buf;
+	int io_buf_index;
+	int uring_readable;
 };
 
 void handle_client(uint32_t event, struct connection *conn);
-void handle_new_connection(void);
+void handle_new_connection(struct worker *w);
 void handle_input(struct connection *conn);
 void handle_output(struct connection *conn);
 
-struct connection *connection_create(int sockfd);
+struct connection *connection_create(struct worker *w, int sockfd);
+void connection_set_state(struct connection *conn, enum connection_state state);
 void connection_remove(struct connection *conn);
+void connection_release(struct connection *conn);
+void connection_free(struct connection *conn);
+void connection_reset_request(struct connection *conn);
 
 int connection_open_file(struct connection *conn);
+void connection_get_recv_buffer(struct connection *conn);
+void connection_get_aio_buffers(struct connection *conn);
+void connection_close_file(struct connection *conn);
 
 int connection_send_dynamic(struct connection *conn);
+int connection_prepare_cached_iov(struct connection *conn);
+void connection_finish_range(struct connection *conn);
+void connection_next_chunk(struct connection *conn);
 void connection_start_async_io(struct connection *conn);
 enum connection_state connection_send_static(struct connection *conn);
-void connection_complete_async_io(struct connection *conn);
+void connection_complete_async_io(struct connection *conn, struct io_event *event);
 void connection_start_async_io(struct connection *conn);
 
 int parse_header(struct connection *conn);
 
 void receive_data(struct connection *conn);
+void connection_prepare_response(struct connection *conn);
+
+void connection_account_sent(struct connection *conn, enum sent_from from, size_t bytes);
+void connection_account_done(struct connection *conn);
+void worker_publish_stats(struct worker *w);
+
+void connection_update_timer(struct connection *conn);
+void worker_expire_timers(struct worker *w);
+int worker_timer_timeout(struct worker *w);
+
+void worker_uring_init(struct worker *w);
+void *worker_uring_loop(void *arg);
 
 
 #ifdef __cplusplus
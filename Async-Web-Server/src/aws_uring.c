@@ -0,0 +1,494 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * io_uring engine. Connections go through the same states as with the
+ * epoll loop, but every accept, recv, file read and send is a submission
+ * queue entry. Each connection has at most one operation in flight, whose
+ * completion moves it to the next state; all entries queued while handling
+ * a batch of completions are submitted by the io_uring_enter(2) call that
+ * waits for the next batch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "aws.h"
+#include "utils/util.h"
+#include "utils/debug.h"
+#include "utils/sock_util.h"
+#include "utils/w_uring.h"
+
+/* user_data of the accept and tick entries; connections use their address */
+#define URING_ACCEPT_TAG	0
+#define URING_TICK_TAG		1
+
+static struct io_uring_sqe *uring_get_sqe(struct worker *w)
+{
+	struct io_uring_sqe *sqe;
+	int rc;
+
+	/* Flush a full submission queue and retry. */
+	while ((sqe = w_uring_get_sqe(&w->ring)) == NULL) {
+		rc = w_uring_submit(&w->ring);
+		DIE(rc < 0, "io_uring_enter");
+	}
+
+	return sqe;
+}
+
+static void uring_set_socket(struct io_uring_sqe *sqe, struct connection *conn)
+{
+	/* Use the registered slot to spare the per-operation file lookup. */
+	if (conn->file_slot >= 0) {
+		sqe->fd = conn->file_slot;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = conn->sockfd;
+	}
+	sqe->user_data = (unsigned long)conn;
+}
+
+static void uring_queue_accept(struct worker *w)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(w);
+
+	w->accept_addrlen = sizeof(w->accept_addr);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = w->listenfd;
+	sqe->addr = (unsigned long)&w->accept_addr;
+	sqe->addr2 = (unsigned long)&w->accept_addrlen;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = URING_ACCEPT_TAG;
+}
+
+static void uring_queue_tick(struct worker *w)
+{
+	/* Wake the loop up for the next timer wheel tick. */
+	struct io_uring_sqe *sqe;
+	int ms = worker_timer_timeout(w);
+
+	if (ms < 0 || w->uring_tick_armed)
+		return;
+
+	w->uring_tick.tv_sec = ms / 1000;
+	w->uring_tick.tv_nsec = (ms % 1000) * 1000000L;
+
+	sqe = uring_get_sqe(w);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)&w->uring_tick;
+	sqe->len = 1;
+	sqe->user_data = URING_TICK_TAG;
+	w->uring_tick_armed = 1;
+}
+
+static void uring_queue_recv(struct connection *conn)
+{
+	/*
+	 * A connection with nothing buffered, such as an idle keep-alive one,
+	 * waits for data without a receive buffer: it polls first, and takes
+	 * a buffer for the recv only once the socket is readable.
+	 */
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->worker);
+
+	if (conn->recv_buffer == NULL && !conn->uring_readable) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		uring_set_socket(sqe, conn);
+		sqe->poll32_events = POLLIN;
+		return;
+	}
+
+	conn->uring_readable = 0;
+	connection_get_recv_buffer(conn);
+
+	sqe->opcode = IORING_OP_RECV;
+	uring_set_socket(sqe, conn);
+	sqe->addr = (unsigned long)(conn->recv_buffer + conn->recv_len);
+	sqe->len = AWS_RECV_BUFFER_SIZE - conn->recv_len;
+}
+
+static void uring_queue_send(struct connection *conn, const char *buf)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->worker);
+
+	sqe->opcode = IORING_OP_SEND;
+	uring_set_socket(sqe, conn);
+	sqe->addr = (unsigned long)(buf + conn->send_pos);
+	sqe->len = conn->send_len - conn->send_pos;
+	sqe->msg_flags = MSG_NOSIGNAL;
+
+	/* Let the header wait for the first chunk of the body. */
+	if (conn->state == STATE_SENDING_HEADER &&
+	    (conn->file_pos < conn->file_end || conn->res_type == RESOURCE_TYPE_HANDLER))
+		sqe->msg_flags |= MSG_MORE;
+}
+
+static void uring_queue_send_cached(struct connection *conn)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->worker);
+
+	sqe->opcode = IORING_OP_WRITEV;
+	uring_set_socket(sqe, conn);
+	sqe->len = connection_prepare_cached_iov(conn);
+	sqe->addr = (unsigned long)conn->send_iov;
+}
+
+static size_t uring_buffer_size(struct connection *conn)
+{
+	return conn->io_buf_index >= 0 ? AWS_URING_BUF_SIZE : AWS_AIO_BUF_SIZE;
+}
+
+static void uring_queue_read(struct connection *conn)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(conn->worker);
+	size_t len = conn->file_end - conn->file_pos;
+
+	if (len > uring_buffer_size(conn))
+		len = uring_buffer_size(conn);
+
+	if (conn->io_buf_index >= 0) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = conn->io_buf_index;
+	} else {
+		sqe->opcode = IORING_OP_READ;
+	}
+	sqe->fd = conn->fd;
+	sqe->off = conn->file_pos;
+	sqe->addr = (unsigned long)conn->io_buf;
+	sqe->len = len;
+	sqe->user_data = (unsigned long)conn;
+}
+
+static void uring_buffer_get(struct connection *conn)
+{
+	/*
+	 * Borrow a registered buffer for the length of a file transfer; when
+	 * all are taken, fall back to a plain read into the connection.
+	 */
+	struct worker *w = conn->worker;
+
+	/* Already held from an earlier range of the same reply. */
+	if (conn->io_buf != NULL)
+		return;
+
+	if (w->uring_nfree > 0) {
+		conn->io_buf_index = w->uring_free[--w->uring_nfree];
+		conn->io_buf = w->uring_bufs + (size_t)conn->io_buf_index * AWS_URING_BUF_SIZE;
+	} else {
+		connection_get_aio_buffers(conn);
+		conn->io_buf_index = -1;
+		conn->io_buf = conn->aio_bufs[0].data;
+	}
+}
+
+static void uring_buffer_put(struct connection *conn)
+{
+	struct worker *w = conn->worker;
+
+	if (conn->io_buf_index >= 0)
+		w->uring_free[w->uring_nfree++] = conn->io_buf_index;
+	conn->io_buf_index = -1;
+	conn->io_buf = NULL;
+}
+
+static void uring_connection_remove(struct connection *conn)
+{
+	/*
+	 * Nothing is in flight for the connection at this point. Empty its file
+	 * slot first: the registered reference would keep the socket open.
+	 */
+	timer_wheel_del(&conn->worker->timers, &conn->timer);
+	if (conn->file_slot >= 0)
+		w_uring_update_file(&conn->worker->ring, conn->file_slot, -1);
+	close(conn->sockfd);
+
+	connection_close_file(conn);
+	uring_buffer_put(conn);
+
+	connection_free(conn);
+}
+
+static void uring_advance(struct connection *conn)
+{
+	/* Run the state machine up to the next operation to wait for. */
+	while (1) {
+		switch (conn->state) {
+		case STATE_INITIAL:
+		case STATE_RECEIVING_DATA:
+			if (conn->recv_len == AWS_RECV_BUFFER_SIZE) {
+				dlog(LOG_INFO, "Received data exceeds buffer size\n");
+				connection_set_state(conn, STATE_CONNECTION_CLOSED);
+				break;
+			}
+			connection_update_timer(conn);
+			uring_queue_recv(conn);
+			return;
+
+		case STATE_REQUEST_RECEIVED:
+			connection_prepare_response(conn);
+			break;
+
+		case STATE_SENDING_HEADER:
+		case STATE_SENDING_404:
+			connection_update_timer(conn);
+			uring_queue_send(conn, conn->send_buffer);
+			return;
+
+		case STATE_SENDING_CACHED:
+			connection_update_timer(conn);
+			uring_queue_send_cached(conn);
+			return;
+
+		case STATE_HEADER_SENT:
+			if (conn->res_type == RESOURCE_TYPE_HANDLER) {
+				connection_next_chunk(conn);
+				break;
+			}
+			if (conn->file_pos == conn->file_end) {
+				connection_set_state(conn, STATE_DATA_SENT);
+				break;
+			}
+			uring_buffer_get(conn);
+			connection_set_state(conn, STATE_ASYNC_ONGOING);
+			break;
+
+		case STATE_ASYNC_ONGOING:
+			connection_update_timer(conn);
+			uring_queue_read(conn);
+			return;
+
+		case STATE_SENDING_DATA:
+			connection_update_timer(conn);
+			if (conn->res_type == RESOURCE_TYPE_HANDLER)
+				uring_queue_send(conn, conn->body);
+			else
+				uring_queue_send(conn, conn->io_buf);
+			return;
+
+		case STATE_DATA_SENT:
+		case STATE_404_SENT:
+			connection_account_done(conn);
+			uring_buffer_put(conn);
+			if (!conn->keep_alive) {
+				uring_connection_remove(conn);
+				return;
+			}
+			/* Either serves a pipelined request or waits for one. */
+			connection_reset_request(conn);
+			break;
+
+		case STATE_CONNECTION_CLOSED:
+		default:
+			uring_connection_remove(conn);
+			return;
+		}
+	}
+}
+
+static void uring_complete(struct connection *conn, int res)
+{
+	/* Account for the operation that just finished. */
+	switch (conn->state) {
+	case STATE_INITIAL:
+	case STATE_RECEIVING_DATA:
+		if (conn->recv_buffer == NULL && res >= 0) {
+			/* The poll fired: the recv queued next takes a buffer. */
+			conn->uring_readable = 1;
+			break;
+		}
+		if (res <= 0) {
+			dlog(LOG_INFO, "Connection closed by client\n");
+			connection_set_state(conn, STATE_CONNECTION_CLOSED);
+			break;
+		}
+		conn->recv_len += res;
+		connection_set_state(conn, STATE_RECEIVING_DATA);
+		parse_header(conn);
+		break;
+
+	case STATE_SENDING_HEADER:
+	case STATE_SENDING_404:
+		if (res < 0) {
+			dlog(LOG_INFO, "send: %s\n", strerror(-res));
+			connection_set_state(conn, STATE_CONNECTION_CLOSED);
+			break;
+		}
+		conn->send_pos += res;
+		connection_account_sent(conn, SENT_HEADER, res);
+		if (conn->send_pos < conn->send_len)
+			break;
+		dlog(LOG_INFO, "Sent header: %s\n", conn->send_buffer);
+		conn->send_pos = 0;
+		connection_set_state(conn, (conn->state == STATE_SENDING_404) ?
+				STATE_404_SENT : STATE_HEADER_SENT);
+		break;
+
+	case STATE_SENDING_CACHED:
+		if (res < 0) {
+			dlog(LOG_INFO, "writev: %s\n", strerror(-res));
+			connection_set_state(conn, STATE_CONNECTION_CLOSED);
+			break;
+		}
+		conn->send_pos += res;
+		connection_account_sent(conn, SENT_MEMORY, res);
+		if (conn->send_pos == conn->send_len)
+			connection_set_state(conn, STATE_DATA_SENT);
+		break;
+
+	case STATE_ASYNC_ONGOING:
+		if (res <= 0) {
+			dlog(LOG_ERR, "Read failed on %s\n", conn->filename);
+			connection_set_state(conn, STATE_CONNECTION_CLOSED);
+			break;
+		}
+		conn->send_len = res;
+		conn->send_pos = 0;
+		connection_set_state(conn, STATE_SENDING_DATA);
+		break;
+
+	case STATE_SENDING_DATA:
+		if (res < 0) {
+			dlog(LOG_INFO, "send: %s\n", strerror(-res));
+			connection_set_state(conn, STATE_CONNECTION_CLOSED);
+			break;
+		}
+		conn->send_pos += res;
+		if (conn->res_type == RESOURCE_TYPE_HANDLER) {
+			/* The next piece is generated once this one is out. */
+			connection_account_sent(conn, SENT_GENERATED, res);
+			if (conn->send_pos == conn->send_len)
+				connection_next_chunk(conn);
+			break;
+		}
+		connection_account_sent(conn, SENT_ASYNC, res);
+		if (conn->send_pos < conn->send_len)
+			break;
+		conn->file_pos += conn->send_len;
+		if (conn->file_pos < conn->file_end)
+			connection_set_state(conn, STATE_ASYNC_ONGOING);
+		else
+			connection_finish_range(conn);
+		break;
+
+	default:
+		connection_set_state(conn, STATE_CONNECTION_CLOSED);
+		break;
+	}
+
+	uring_advance(conn);
+}
+
+static void uring_accept(struct worker *w, int sockfd)
+{
+	struct connection *conn;
+	char addr_str[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &w->accept_addr.sin_addr, addr_str, sizeof(addr_str));
+	dlog(LOG_ERR, "Worker %d accepted connection from: %s:%d\n",
+	     w->id, addr_str, ntohs(w->accept_addr.sin_port));
+
+	/*
+	 * The socket stays blocking: io_uring polls it internally instead of
+	 * failing operations with EAGAIN.
+	 */
+	conn = connection_create(w, sockfd);
+
+	if (w->uring_files && sockfd < AWS_URING_FILES &&
+	    w_uring_update_file(&w->ring, sockfd, sockfd) >= 0)
+		conn->file_slot = sockfd;
+
+	uring_advance(conn);
+}
+
+void worker_uring_init(struct worker *w)
+{
+	static int fds[AWS_URING_FILES];
+	struct iovec iov[AWS_URING_BUFFERS];
+	int rc;
+	int i;
+
+	rc = w_uring_setup(&w->ring, AWS_URING_ENTRIES);
+	DIE(rc < 0, "io_uring_setup");
+	w->uring_tick_armed = 0;
+
+	/*
+	 * Registered buffers spare the kernel mapping user pages on every read
+	 * and registered files spare the file table lookup on every socket
+	 * operation. Both are optional: the engine runs without them.
+	 */
+	w->uring_bufs = mmap(NULL, (size_t)AWS_URING_BUFFERS * AWS_URING_BUF_SIZE,
+			     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	DIE(w->uring_bufs == MAP_FAILED, "mmap");
+
+	for (i = 0; i < AWS_URING_BUFFERS; i++) {
+		iov[i].iov_base = w->uring_bufs + (size_t)i * AWS_URING_BUF_SIZE;
+		iov[i].iov_len = AWS_URING_BUF_SIZE;
+	}
+	w->uring_nfree = 0;
+	if (w_uring_register_buffers(&w->ring, iov, AWS_URING_BUFFERS) < 0) {
+		dlog(LOG_WARNING, "Worker %d: cannot register buffers: %s\n", w->id, strerror(errno));
+	} else {
+		for (i = 0; i < AWS_URING_BUFFERS; i++)
+			w->uring_free[w->uring_nfree++] = i;
+	}
+
+	for (i = 0; i < AWS_URING_FILES; i++)
+		fds[i] = -1;
+	w->uring_files = w_uring_register_files(&w->ring, fds, AWS_URING_FILES) >= 0;
+	if (!w->uring_files)
+		dlog(LOG_WARNING, "Worker %d: cannot register files: %s\n", w->id, strerror(errno));
+}
+
+void *worker_uring_loop(void *arg)
+{
+	struct worker *w = arg;
+	struct io_uring_cqe *cqe;
+	unsigned long user_data;
+	int res;
+	int rc;
+
+	uring_queue_accept(w);
+
+	/* worker main loop */
+	while (1) {
+		/* Submit what the last batch queued and wait for completions. */
+		rc = w_uring_submit_and_wait(&w->ring, 1);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		DIE(rc < 0, "io_uring_enter");
+
+		while ((cqe = w_uring_peek_cqe(&w->ring)) != NULL) {
+			user_data = cqe->user_data;
+			res = cqe->res;
+			w_uring_cqe_seen(&w->ring);
+
+			if (user_data == URING_TICK_TAG) {
+				w->uring_tick_armed = 0;
+				continue;
+			}
+			if (user_data != URING_ACCEPT_TAG) {
+				uring_complete((struct connection *)user_data, res);
+				continue;
+			}
+
+			if (res >= 0)
+				uring_accept(w, res);
+			else
+				dlog(LOG_ERR, "accept: %s\n", strerror(-res));
+			uring_queue_accept(w);
+		}
+
+		worker_expire_timers(w);
+		worker_publish_stats(w);
+		uring_queue_tick(w);
+	}
+
+	return NULL;
+}
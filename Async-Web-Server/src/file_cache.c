@@ -0,0 +1,292 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "file_cache.h"
+#include "utils/util.h"
+#include "utils/debug.h"
+
+const char * const file_encoding_names[FILE_ENCODING_COUNT] = {
+	[FILE_ENCODING_GZIP] = "gzip",
+	[FILE_ENCODING_ZSTD] = "zstd",
+};
+
+const char * const file_encoding_suffixes[FILE_ENCODING_COUNT] = {
+	[FILE_ENCODING_GZIP] = ".gz",
+	[FILE_ENCODING_ZSTD] = ".zst",
+};
+
+static unsigned int file_cache_hash(const char *path)
+{
+	/* FNV-1a */
+	unsigned int h = 2166136261u;
+
+	while (*path) {
+		h ^= (unsigned char)*path++;
+		h *= 16777619u;
+	}
+
+	return h % FILE_CACHE_BUCKETS;
+}
+
+static time_t file_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return ts.tv_sec;
+}
+
+static void lru_unlink(struct file_cache *fc, struct file_cache_entry *e)
+{
+	if (e->lru_prev != NULL)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		fc->lru_head = e->lru_next;
+	if (e->lru_next != NULL)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		fc->lru_tail = e->lru_prev;
+	e->lru_prev = NULL;
+	e->lru_next = NULL;
+}
+
+static void lru_push_front(struct file_cache *fc, struct file_cache_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = fc->lru_head;
+	if (fc->lru_head != NULL)
+		fc->lru_head->lru_prev = e;
+	else
+		fc->lru_tail = e;
+	fc->lru_head = e;
+}
+
+static void file_cache_unhash(struct file_cache *fc, struct file_cache_entry *e)
+{
+	struct file_cache_entry **p = &fc->buckets[file_cache_hash(e->path)];
+
+	while (*p != e)
+		p = &(*p)->hash_next;
+	*p = e->hash_next;
+
+	lru_unlink(fc, e);
+	fc->count--;
+}
+
+static void file_cache_free(struct file_cache_entry *e)
+{
+	close(e->fd);
+	free(e->response);
+	free(e->path);
+	free(e);
+}
+
+static unsigned int file_cache_encodings(const char *path, const struct stat *st)
+{
+	/* Find the precompressed variants of the file that are up to date. */
+	unsigned int encodings = 0;
+	char variant[PATH_MAX];
+	struct stat vst;
+	int i;
+
+	for (i = 0; i < FILE_ENCODING_COUNT; i++) {
+		if (snprintf(variant, sizeof(variant), "%s%s", path,
+			     file_encoding_suffixes[i]) >= (int)sizeof(variant))
+			continue;
+		if (stat(variant, &vst) < 0 || !S_ISREG(vst.st_mode))
+			continue;
+		if (vst.st_mtim.tv_sec < st->st_mtim.tv_sec ||
+		    (vst.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+		     vst.st_mtim.tv_nsec < st->st_mtim.tv_nsec))
+			continue;
+		encodings |= 1U << i;
+	}
+
+	return encodings;
+}
+
+static void file_cache_set_validators(struct file_cache_entry *e)
+{
+	/*
+	 * Any change of the file that the entry's revalidation notices changes
+	 * its ETag as well, so no file data has to be hashed.
+	 */
+	unsigned long long mtime = e->st.st_mtim.tv_sec * 1000000000ULL + e->st.st_mtim.tv_nsec;
+	struct tm tm;
+
+	e->etag_len = snprintf(e->etag, sizeof(e->etag), "\"%lx-%lx-%llx\"",
+			       (unsigned long)e->st.st_ino, (unsigned long)e->st.st_size, mtime);
+
+	gmtime_r(&e->st.st_mtim.tv_sec, &tm);
+	strftime(e->last_modified, sizeof(e->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	e->validators_len = snprintf(e->validators, sizeof(e->validators),
+				     "ETag: %s\r\nLast-Modified: %s\r\n",
+				     e->etag, e->last_modified);
+}
+
+static void file_cache_load_response(struct file_cache *fc, struct file_cache_entry *e)
+{
+	/*
+	 * Render the response of a small file once: a hit is then sent straight
+	 * from memory, with no header formatting and no file I/O.
+	 */
+	size_t size = e->st.st_size;
+	char header[256];
+	int len;
+
+	if (size > fc->response_max)
+		return;
+
+	len = snprintf(header, sizeof(header),
+		       "HTTP/1.1 200 OK\r\n"
+		       "Content-Length: %ld\r\n"
+		       "Accept-Ranges: bytes\r\n"
+		       "%s%s", (long)size, e->validators,
+		       e->encodings ? "Vary: Accept-Encoding\r\n" : "");
+
+	e->response = malloc(len + size);
+	DIE(e->response == NULL, "malloc");
+	memcpy(e->response, header, len);
+
+	if (pread(e->fd, e->response + len, size, 0) != (ssize_t)size) {
+		free(e->response);
+		e->response = NULL;
+		return;
+	}
+
+	e->header_len = len;
+	e->response_len = len + size;
+	fc->misses++;
+}
+
+static void file_cache_evict(struct file_cache *fc)
+{
+	/* Drop unused entries, least recently used first, to fit the bound. */
+	struct file_cache_entry *e = fc->lru_tail;
+	struct file_cache_entry *prev;
+
+	while (fc->count > FILE_CACHE_SIZE && e != NULL) {
+		prev = e->lru_prev;
+		if (e->refs == 0) {
+			if (e->response != NULL)
+				fc->evictions++;
+			file_cache_unhash(fc, e);
+			file_cache_free(e);
+		}
+		e = prev;
+	}
+}
+
+static int file_cache_changed(struct file_cache_entry *e)
+{
+	struct stat st;
+
+	if (stat(e->path, &st) < 0)
+		return 1;
+
+	if (st.st_ino != e->st.st_ino || st.st_dev != e->st.st_dev ||
+	    st.st_size != e->st.st_size ||
+	    st.st_mtim.tv_sec != e->st.st_mtim.tv_sec ||
+	    st.st_mtim.tv_nsec != e->st.st_mtim.tv_nsec)
+		return 1;
+
+	/* A variant appearing or going stale changes the responses too. */
+	return file_cache_encodings(e->path, &st) != e->encodings;
+}
+
+void file_cache_init(struct file_cache *fc, size_t response_max)
+{
+	memset(fc, 0, sizeof(*fc));
+	fc->response_max = response_max;
+}
+
+/*
+ * Return an entry for the regular file at path with a reference taken, or
+ * NULL if it cannot be opened. Drop the reference with file_cache_release().
+ */
+
+struct file_cache_entry *file_cache_open(struct file_cache *fc, const char *path)
+{
+	unsigned int bucket = file_cache_hash(path);
+	time_t now = file_cache_now();
+	struct file_cache_entry *e;
+	int fd;
+
+	for (e = fc->buckets[bucket]; e != NULL; e = e->hash_next)
+		if (strcmp(e->path, path) == 0)
+			break;
+
+	if (e != NULL && now - e->checked >= FILE_CACHE_REVALIDATE) {
+		if (file_cache_changed(e)) {
+			/* Requests still sending the old file keep it open. */
+			file_cache_unhash(fc, e);
+			if (e->refs == 0)
+				file_cache_free(e);
+			else
+				e->stale = 1;
+			e = NULL;
+		} else {
+			e->checked = now;
+		}
+	}
+
+	if (e != NULL) {
+		lru_unlink(fc, e);
+		lru_push_front(fc, e);
+		e->refs++;
+		return e;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	e = calloc(1, sizeof(*e));
+	DIE(e == NULL, "calloc");
+
+	if (fstat(fd, &e->st) < 0 || !S_ISREG(e->st.st_mode)) {
+		close(fd);
+		free(e);
+		return NULL;
+	}
+
+	e->path = strdup(path);
+	DIE(e->path == NULL, "strdup");
+	e->fd = fd;
+	e->checked = now;
+	e->refs = 1;
+	e->encodings = file_cache_encodings(path, &e->st);
+	file_cache_set_validators(e);
+	file_cache_load_response(fc, e);
+
+	e->hash_next = fc->buckets[bucket];
+	fc->buckets[bucket] = e;
+	lru_push_front(fc, e);
+	fc->count++;
+
+	file_cache_evict(fc);
+
+	return e;
+}
+
+void file_cache_release(struct file_cache *fc, struct file_cache_entry *e)
+{
+	e->refs--;
+	if (e->refs > 0)
+		return;
+
+	if (e->stale)
+		file_cache_free(e);
+	else if (fc->count > FILE_CACHE_SIZE)
+		file_cache_evict(fc);
+}
@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef FILE_CACHE_H_
+#define FILE_CACHE_H_	1
+
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* open files kept per worker, and hash buckets used to find them */
+#define FILE_CACHE_SIZE		256
+#define FILE_CACHE_BUCKETS	1024
+
+/* seconds an entry is trusted before its path is stat(2)ed again */
+#define FILE_CACHE_REVALIDATE	1
+
+/* files up to this size get their whole response kept in memory */
+#define FILE_CACHE_RESPONSE_MAX	(16 * 1024)
+
+/*
+ * Precompressed variants of a file, looked for next to it as path.gz and
+ * path.zst. A variant older than the file is ignored as out of date.
+ */
+enum file_encoding {
+	FILE_ENCODING_GZIP,
+	FILE_ENCODING_ZSTD,
+	FILE_ENCODING_COUNT
+};
+
+/* Content-Encoding names and file name suffixes, by enum file_encoding */
+extern const char * const file_encoding_names[FILE_ENCODING_COUNT];
+extern const char * const file_encoding_suffixes[FILE_ENCODING_COUNT];
+
+/*
+ * Open descriptor and metadata of a regular file, shared by every request
+ * for the same path. Requests use the descriptor with explicit offsets
+ * only, so any number of them can read it at once.
+ */
+struct file_cache_entry {
+	char *path;
+	int fd;
+	struct stat st;
+	time_t checked;
+
+	/* requests using the entry; it is only closed once unused */
+	int refs;
+	/* the file changed on disk; dropped from the table on last release */
+	int stale;
+
+	/*
+	 * Validators of this version of the file, derived from its inode, size
+	 * and modification time, and the ETag and Last-Modified header lines
+	 * carrying them.
+	 */
+	char etag[64];
+	size_t etag_len;
+	char last_modified[32];
+	char validators[128];
+	size_t validators_len;
+
+	/* one bit per enum file_encoding with an up to date variant */
+	unsigned int encodings;
+
+	/*
+	 * Small files only: status line and the headers that depend on the file
+	 * alone, followed by the body, in one buffer. The Connection header,
+	 * which depends on the request, goes between the two parts when the
+	 * response is sent.
+	 */
+	char *response;
+	size_t header_len;
+	size_t response_len;
+
+	struct file_cache_entry *hash_next;
+	struct file_cache_entry *lru_prev;
+	struct file_cache_entry *lru_next;
+};
+
+/*
+ * Bounded LRU table of open files. Hot files cost no path lookup at all
+ * between revalidations; a revalidation is a single stat(2) compared with
+ * the cached inode, size and modification time.
+ */
+struct file_cache {
+	struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+	/* most recently used first */
+	struct file_cache_entry *lru_head;
+	struct file_cache_entry *lru_tail;
+	unsigned int count;
+
+	/* largest file whose response is kept in memory; 0 disables it */
+	size_t response_max;
+
+	/*
+	 * In-memory responses rendered and thrown out for room. Responses
+	 * actually served from memory are counted by the server, which alone
+	 * knows whether a request could use one.
+	 */
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+void file_cache_init(struct file_cache *fc, size_t response_max);
+struct file_cache_entry *file_cache_open(struct file_cache *fc, const char *path);
+void file_cache_release(struct file_cache *fc, struct file_cache_entry *e);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FILE_CACHE_H_ */
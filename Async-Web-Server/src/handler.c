@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <string.h>
+
+#include "handler.h"
+
+/* largest count a demo body may be asked for: 16 MiB, or 16Mi lines */
+#define HANDLER_COUNT_MAX	(1ULL << 24)
+
+static const struct handler *handlers[HANDLER_MAX];
+static size_t num_handlers;
+
+static int parse_count(const char *arg, size_t len, uint64_t *count)
+{
+	/* Decimal count making up the whole argument. */
+	uint64_t n = 0;
+	size_t i;
+
+	if (len == 0)
+		return -1;
+
+	for (i = 0; i < len; i++) {
+		if (arg[i] < '0' || arg[i] > '9')
+			return -1;
+		n = n * 10 + (arg[i] - '0');
+		if (n > HANDLER_COUNT_MAX)
+			return -1;
+	}
+
+	*count = n;
+	return 0;
+}
+
+/* /stream/bytes/<n>: n bytes of a repeating alphabet */
+
+struct bytes_state {
+	uint64_t left;
+	uint64_t pos;
+};
+
+static int bytes_start(void *state, const char *arg, size_t arg_len)
+{
+	struct bytes_state *s = state;
+
+	return parse_count(arg, arg_len, &s->left);
+}
+
+static ssize_t bytes_generate(void *state, char *buf, size_t size)
+{
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789\n";
+	struct bytes_state *s = state;
+	size_t n = size;
+	size_t i;
+
+	if (n > s->left)
+		n = s->left;
+
+	for (i = 0; i < n; i++)
+		buf[i] = alphabet[(s->pos + i) % (sizeof(alphabet) - 1)];
+
+	s->pos += n;
+	s->left -= n;
+
+	return n;
+}
+
+/* /stream/lines/<n>: lines numbered from 1 to n */
+
+struct lines_state {
+	uint64_t next;
+	uint64_t last;
+};
+
+static int lines_start(void *state, const char *arg, size_t arg_len)
+{
+	struct lines_state *s = state;
+
+	s->next = 1;
+	return parse_count(arg, arg_len, &s->last);
+}
+
+static ssize_t lines_generate(void *state, char *buf, size_t size)
+{
+	/* Whole lines only: each one is "line <number>\n". */
+	struct lines_state *s = state;
+	char digits[24];
+	char *p;
+	size_t len = 0;
+	size_t line_len;
+	uint64_t v;
+
+	while (s->next <= s->last) {
+		p = digits + sizeof(digits);
+		*--p = '\n';
+		v = s->next;
+		do {
+			*--p = '0' + v % 10;
+			v /= 10;
+		} while (v > 0);
+
+		line_len = 5 + (digits + sizeof(digits) - p);
+		if (len + line_len > size)
+			break;
+		memcpy(buf + len, "line ", 5);
+		memcpy(buf + len + 5, p, line_len - 5);
+		len += line_len;
+		s->next++;
+	}
+
+	return len;
+}
+
+static const struct handler demo_handlers[] = {
+	HANDLER("stream/bytes/", "application/octet-stream", bytes),
+	HANDLER("stream/lines/", "text/plain", lines),
+};
+
+int handler_register(const struct handler *h)
+{
+	if (num_handlers == HANDLER_MAX)
+		return -1;
+
+	handlers[num_handlers++] = h;
+	return 0;
+}
+
+void handler_register_demos(void)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(demo_handlers) / sizeof(demo_handlers[0]); i++)
+		handler_register(&demo_handlers[i]);
+}
+
+const struct handler *handler_find(const char *path, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < num_handlers; i++)
+		if (len >= handlers[i]->prefix_len &&
+		    memcmp(path, handlers[i]->prefix, handlers[i]->prefix_len) == 0)
+			return handlers[i];
+
+	return NULL;
+}
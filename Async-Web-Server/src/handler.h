@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef HANDLER_H_
+#define HANDLER_H_	1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* room a handler has for the state of one response */
+#define HANDLER_STATE_SIZE	64
+
+/* most handlers that can be registered */
+#define HANDLER_MAX		16
+
+/*
+ * Generator of response bodies for the request paths below prefix, which is
+ * relative to the document root. start() is given the rest of the path and
+ * a zeroed state to set up, and returns -1 to have the request answered
+ * with 404. generate() then writes the next piece of the body, at most size
+ * bytes, into buf and returns its length; 0 ends the body and -1 aborts the
+ * response. It is only called once the previous piece has been sent, so a
+ * body is produced as fast as the client reads it and never held whole.
+ */
+struct handler {
+	const char *prefix;
+	size_t prefix_len;
+	const char *content_type;
+	size_t content_type_len;
+	int (*start)(void *state, const char *arg, size_t arg_len);
+	ssize_t (*generate)(void *state, char *buf, size_t size);
+};
+
+#define HANDLER(prefix, type, name)					\
+	{ prefix, sizeof(prefix) - 1, type, sizeof(type) - 1,		\
+	  name ## _start, name ## _generate }
+
+/*
+ * Serve the paths below h->prefix with h, which must outlive the server.
+ * Handlers are registered before the workers start and matched in the order
+ * they were registered. Returns -1 if HANDLER_MAX are already registered.
+ */
+int handler_register(const struct handler *h);
+
+/* Register the /stream/bytes/<n> and /stream/lines/<n> demo handlers. */
+void handler_register_demos(void);
+
+const struct handler *handler_find(const char *path, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HANDLER_H_ */
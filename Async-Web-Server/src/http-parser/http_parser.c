@@ -21,6 +21,16 @@
 #include "http_parser.h"
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
+
+/* Compile with -DHTTP_PARSER_NO_SIMD to leave out the vector scanners */
+#if !defined(HTTP_PARSER_NO_SIMD) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__i386__))
+# define HTTP_PARSER_SIMD 1
+# include <immintrin.h>
+#else
+# define HTTP_PARSER_SIMD 0
+#endif
 
 
 #ifndef MIN
@@ -41,9 +51,17 @@ do {                                                                 \
   FOR##_mark = p;                                                    \
 } while (0)
 
+/* The byte at p has offset nread - 1 in the message, or, once the loop is
+ * done and p is pe, nread.
+ */
 #define CALLBACK_NOCLEAR(FOR)                                        \
 do {                                                                 \
   if (FOR##_mark) {                                                  \
+    if (parser->spans) {                                             \
+      span_##FOR(parser,                                             \
+                 nread - (p != pe) - (p - FOR##_mark),               \
+                 p - FOR##_mark);                                    \
+    }                                                                \
     if (settings->on_##FOR) {                                        \
       if (0 != settings->on_##FOR(parser,                            \
                                  FOR##_mark,                         \
@@ -309,6 +327,228 @@ enum flags
 #define start_state (parser->type == HTTP_REQUEST ? s_start_req : s_start_res)
 
 
+/* Part of the last header the spans were given */
+enum span_last
+  { SPAN_NONE = 0
+  , SPAN_NAME
+  , SPAN_VALUE
+  };
+
+
+static void
+span_add (http_parser_span *span, uint32_t off, uint32_t len)
+{
+  /* Pieces of a part come in order and follow each other in the message */
+  if (span->len == 0) span->off = off;
+  span->len += len;
+}
+
+
+static void
+span_begin (http_parser *parser, uint32_t off)
+{
+  http_parser_spans *spans = parser->spans;
+
+  memset(&spans->method, 0, sizeof(spans->method));
+  spans->method.off = off;
+  memset(&spans->url, 0, sizeof(spans->url));
+  memset(&spans->path, 0, sizeof(spans->path));
+  memset(&spans->query_string, 0, sizeof(spans->query_string));
+  memset(&spans->fragment, 0, sizeof(spans->fragment));
+  spans->num_headers = 0;
+  spans->headers_dropped = 0;
+  spans->last = SPAN_NONE;
+}
+
+
+#define SPAN_PART(FOR)                                               \
+static void                                                          \
+span_##FOR (http_parser *parser, uint32_t off, uint32_t len)        \
+{                                                                    \
+  span_add(&parser->spans->FOR, off, len);                           \
+}
+
+SPAN_PART(url)
+SPAN_PART(path)
+SPAN_PART(query_string)
+SPAN_PART(fragment)
+
+
+static void
+span_header_field (http_parser *parser, uint32_t off, uint32_t len)
+{
+  http_parser_spans *spans = parser->spans;
+  http_parser_header *header;
+
+  if (parser->flags & F_TRAILING) return;
+
+  if (spans->last != SPAN_NAME) {
+    spans->last = SPAN_NAME;
+    if (spans->num_headers == spans->max_headers) {
+      spans->headers_dropped = 1;
+      return;
+    }
+    header = &spans->headers[spans->num_headers++];
+    memset(header, 0, sizeof(*header));
+  }
+
+  if (spans->headers_dropped) return;
+  span_add(&spans->headers[spans->num_headers - 1].name, off, len);
+}
+
+
+static void
+span_header_value (http_parser *parser, uint32_t off, uint32_t len)
+{
+  http_parser_spans *spans = parser->spans;
+
+  if (parser->flags & F_TRAILING) return;
+
+  spans->last = SPAN_VALUE;
+  if (spans->headers_dropped || spans->num_headers == 0) return;
+  span_add(&spans->headers[spans->num_headers - 1].value, off, len);
+}
+
+/* Runs of plain URL bytes (see normal_url_char) and of general header value
+ * bytes (anything but CR and LF) make up most of a request, so they are
+ * skipped in bulk instead of going around the state machine once per byte.
+ * A scanner returns the first byte in [p, pe) that ends the run, or pe.
+ * Like picohttpparser, the vector ones look at 16 (SSE4.2) or 32 (AVX2)
+ * bytes at a time and leave the tail to the scalar loop.
+ */
+typedef const char *(*scan_fn) (const char *p, const char *pe);
+
+struct scanners {
+  scan_fn url;
+  scan_fn value;
+};
+
+
+static const char *
+scan_url_scalar (const char *p, const char *pe)
+{
+  while (p != pe && normal_url_char[(unsigned char)*p]) p++;
+  return p;
+}
+
+
+static const char *
+scan_value_scalar (const char *p, const char *pe)
+{
+  while (p != pe && *p != CR && *p != LF) p++;
+  return p;
+}
+
+
+#if HTTP_PARSER_SIMD
+
+#define SSE42_RANGES (_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT)
+
+/* Byte ranges ending a run, in pairs, for PCMPESTRI */
+static const char url_stop_ranges[16] = "\x00\x20" "##" "??" "\x7f\xff";
+static const char value_stop_ranges[16] = "\r\r" "\n\n";
+
+
+__attribute__((target("sse4.2")))
+static const char *
+scan_url_sse42 (const char *p, const char *pe)
+{
+  __m128i ranges = _mm_loadu_si128((const __m128i *)url_stop_ranges);
+
+  for (; pe - p >= 16; p += 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)p);
+    int i = _mm_cmpestri(ranges, 8, b, 16, SSE42_RANGES);
+    if (i != 16) return p + i;
+  }
+  return scan_url_scalar(p, pe);
+}
+
+
+__attribute__((target("sse4.2")))
+static const char *
+scan_value_sse42 (const char *p, const char *pe)
+{
+  __m128i ranges = _mm_loadu_si128((const __m128i *)value_stop_ranges);
+
+  for (; pe - p >= 16; p += 16) {
+    __m128i b = _mm_loadu_si128((const __m128i *)p);
+    int i = _mm_cmpestri(ranges, 4, b, 16, SSE42_RANGES);
+    if (i != 16) return p + i;
+  }
+  return scan_value_scalar(p, pe);
+}
+
+
+__attribute__((target("avx2")))
+static const char *
+scan_url_avx2 (const char *p, const char *pe)
+{
+  /* Bytes from 0x80 up are negative, so the signed compare with space
+   * catches them together with the control characters.
+   */
+  const __m256i space = _mm256_set1_epi8(' ');
+  const __m256i hash = _mm256_set1_epi8('#');
+  const __m256i question = _mm256_set1_epi8('?');
+  const __m256i del = _mm256_set1_epi8(0x7f);
+
+  for (; pe - p >= 32; p += 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)p);
+    __m256i plain = _mm256_cmpgt_epi8(b, space);
+    __m256i stop = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(b, hash),
+                        _mm256_cmpeq_epi8(b, question)),
+        _mm256_cmpeq_epi8(b, del));
+    unsigned int mask = ~_mm256_movemask_epi8(plain) |
+                        _mm256_movemask_epi8(stop);
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return scan_url_scalar(p, pe);
+}
+
+
+__attribute__((target("avx2")))
+static const char *
+scan_value_avx2 (const char *p, const char *pe)
+{
+  const __m256i cr = _mm256_set1_epi8(CR);
+  const __m256i lf = _mm256_set1_epi8(LF);
+
+  for (; pe - p >= 32; p += 32) {
+    __m256i b = _mm256_loadu_si256((const __m256i *)p);
+    unsigned int mask = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(b, cr), _mm256_cmpeq_epi8(b, lf)));
+    if (mask) return p + __builtin_ctz(mask);
+  }
+  return scan_value_scalar(p, pe);
+}
+
+#endif /* HTTP_PARSER_SIMD */
+
+
+static const struct scanners all_scanners[] =
+  { [HTTP_PARSER_SIMD_NONE] = { scan_url_scalar, scan_value_scalar }
+#if HTTP_PARSER_SIMD
+  , [HTTP_PARSER_SIMD_SSE42] = { scan_url_sse42, scan_value_sse42 }
+  , [HTTP_PARSER_SIMD_AVX2] = { scan_url_avx2, scan_value_avx2 }
+#endif
+  };
+
+static const struct scanners *scanners = &all_scanners[HTTP_PARSER_SIMD_NONE];
+
+
+/* Moves p onto the last byte of the run that starts at p, so that the loop
+ * goes on with the byte ending it. The skipped bytes still count toward
+ * HTTP_MAX_HEADER_SIZE.
+ */
+#define SKIP_RUN(SCAN)                                               \
+do {                                                                 \
+  const char *run_end = SCAN(p + 1, pe);                             \
+  nread += run_end - (p + 1);                                        \
+  if (nread > HTTP_MAX_HEADER_SIZE) goto error;                      \
+  p = run_end - 1;                                                   \
+} while (0)
+
+
 #if HTTP_PARSER_STRICT
 # define STRICT_CHECK(cond) if (cond) goto error
 # define NEW_MESSAGE() (http_should_keep_alive(parser) ? start_state : s_dead)
@@ -331,6 +571,8 @@ size_t http_parser_execute (http_parser *parser,
   enum header_states header_state = (enum header_states) parser->header_state;
   uint64_t index = parser->index;
   uint64_t nread = parser->nread;
+  scan_fn scan_url = scanners->url;
+  scan_fn scan_value = scanners->value;
 
   if (len == 0) {
     switch (state) {
@@ -402,6 +644,8 @@ size_t http_parser_execute (http_parser *parser,
 
         CALLBACK2(message_begin);
 
+        if (parser->spans) span_begin(parser, nread - 1);
+
         if (ch == 'H')
           state = s_res_or_resp_H;
         else {
@@ -431,6 +675,8 @@ size_t http_parser_execute (http_parser *parser,
 
         CALLBACK2(message_begin);
 
+        if (parser->spans) span_begin(parser, nread - 1);
+
         switch (ch) {
           case 'H':
             state = s_res_H;
@@ -580,6 +826,8 @@ size_t http_parser_execute (http_parser *parser,
 
         CALLBACK2(message_begin);
 
+        if (parser->spans) span_begin(parser, nread - 1);
+
         if (ch < 'A' || 'Z' < ch) goto error;
 
       start_req_method_assign:
@@ -612,6 +860,7 @@ size_t http_parser_execute (http_parser *parser,
 
         const char *matcher = method_strings[parser->method];
         if (ch == ' ' && matcher[index] == '\0') {
+          if (parser->spans) parser->spans->method.len = index;
           state = s_req_spaces_before_url;
         } else if (ch == matcher[index]) {
           ; /* nada */
@@ -749,7 +998,10 @@ size_t http_parser_execute (http_parser *parser,
 
       case s_req_path:
       {
-        if (normal_url_char[(unsigned char)ch]) break;
+        if (normal_url_char[(unsigned char)ch]) {
+          SKIP_RUN(scan_url);
+          break;
+        }
 
         switch (ch) {
           case ' ':
@@ -823,7 +1075,10 @@ size_t http_parser_execute (http_parser *parser,
 
       case s_req_query_string:
       {
-        if (normal_url_char[(unsigned char)ch]) break;
+        if (normal_url_char[(unsigned char)ch]) {
+          SKIP_RUN(scan_url);
+          break;
+        }
 
         switch (ch) {
           case '?':
@@ -897,7 +1152,10 @@ size_t http_parser_execute (http_parser *parser,
 
       case s_req_fragment:
       {
-        if (normal_url_char[(unsigned char)ch]) break;
+        if (normal_url_char[(unsigned char)ch]) {
+          SKIP_RUN(scan_url);
+          break;
+        }
 
         switch (ch) {
           case ' ':
@@ -1279,6 +1537,7 @@ size_t http_parser_execute (http_parser *parser,
 
         switch (header_state) {
           case h_general:
+            SKIP_RUN(scan_value);
             break;
 
           case h_connection:
@@ -1369,6 +1628,7 @@ size_t http_parser_execute (http_parser *parser,
 
         if (parser->flags & F_TRAILING) {
           /* End of a chunked request */
+          nread = 0;
           CALLBACK2(message_complete);
           state = NEW_MESSAGE();
           break;
@@ -1437,7 +1697,7 @@ size_t http_parser_execute (http_parser *parser,
       }
 
       case s_body_identity:
-        to_read = MIN((size_t)(pe - p), parser->content_length);
+        to_read = MIN(pe - p, parser->content_length);
         if (to_read > 0) {
           if (settings->on_body) settings->on_body(parser, p, to_read);
           p += to_read - 1;
@@ -1532,7 +1792,7 @@ size_t http_parser_execute (http_parser *parser,
           p += to_read - 1;
         }
 
-        if (to_read == parser->content_length) {
+        if ((int64_t)to_read == parser->content_length) {
           state = s_chunk_data_almost_done;
         }
 
@@ -1568,7 +1828,7 @@ size_t http_parser_execute (http_parser *parser,
   parser->state = state;
   parser->header_state = header_state;
   parser->index = (unsigned char)index;
-  parser->nread = (unsigned char)nread;
+  parser->nread = nread;
 
   return len;
 
@@ -1599,6 +1859,36 @@ http_should_keep_alive (http_parser *parser)
 }
 
 
+enum http_parser_simd
+http_parser_set_simd (enum http_parser_simd level)
+{
+#if HTTP_PARSER_SIMD
+  __builtin_cpu_init();
+  if (level >= HTTP_PARSER_SIMD_AVX2 && !__builtin_cpu_supports("avx2"))
+    level = HTTP_PARSER_SIMD_SSE42;
+  if (level >= HTTP_PARSER_SIMD_SSE42 && !__builtin_cpu_supports("sse4.2"))
+    level = HTTP_PARSER_SIMD_NONE;
+  if (level > HTTP_PARSER_SIMD_AVX2)
+    level = HTTP_PARSER_SIMD_AVX2;
+#else
+  level = HTTP_PARSER_SIMD_NONE;
+#endif
+  scanners = &all_scanners[level];
+  return level;
+}
+
+
+#if HTTP_PARSER_SIMD
+/* Pick the best scanners once, before any thread can be parsing */
+__attribute__((constructor))
+static void
+http_parser_simd_init (void)
+{
+  http_parser_set_simd(HTTP_PARSER_SIMD_AVX2);
+}
+#endif
+
+
 const char * http_method_str (enum http_method m)
 {
   return method_strings[m];
@@ -1614,4 +1904,5 @@ http_parser_init (http_parser *parser, enum http_parser_type t)
   parser->upgrade = 0;
   parser->flags = 0;
   parser->method = 0;
+  parser->spans = NULL;
 }
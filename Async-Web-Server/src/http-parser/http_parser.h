@@ -58,6 +58,7 @@ typedef int ssize_t;
 
 typedef struct http_parser http_parser;
 typedef struct http_parser_settings http_parser_settings;
+typedef struct http_parser_spans http_parser_spans;
 
 
 /* Callbacks should return non-zero to indicate an error. The parser will
@@ -121,7 +122,7 @@ struct http_parser {
   unsigned char index;
 
   uint32_t nread;
-  size_t content_length;
+  int64_t content_length;
 
   /** READ-ONLY **/
   unsigned short http_major;
@@ -138,6 +139,55 @@ struct http_parser {
 
   /** PUBLIC **/
   void *data; /* A pointer to get hook to the "connection" or "socket" object */
+
+  /* Where to record the extents of the request line and headers, or NULL.
+   * Reset by http_parser_init(). See struct http_parser_spans.
+   */
+  http_parser_spans *spans;
+};
+
+
+/* Extent of part of a message: an offset from the start of the message and
+ * a length. A message starts with the first byte given to the parser after
+ * http_parser_init() or after the end of the previous message, blank lines
+ * before the request line included. len is 0 for a part that is absent.
+ */
+typedef struct http_parser_span {
+  uint32_t off;
+  uint32_t len;
+} http_parser_span;
+
+typedef struct http_parser_header {
+  http_parser_span name;
+  http_parser_span value;
+} http_parser_header;
+
+
+/* Spans of a message, filled in as it is parsed when http_parser.spans
+ * points here. They are complete by the time on_headers_complete is called
+ * and stay valid for as long as the caller keeps the message where it gave
+ * it to the parser, so the request line and headers can be read in place
+ * instead of being pieced together from the data callbacks, which may each
+ * report a part in several pieces. Trailing headers of a chunked body are
+ * not recorded.
+ */
+struct http_parser_spans {
+  /** PUBLIC **/
+  http_parser_header *headers; /* room for max_headers headers */
+  unsigned int max_headers;
+
+  /** READ-ONLY **/
+  http_parser_span method;     /* requests only */
+  http_parser_span url;
+  http_parser_span path;
+  http_parser_span query_string;
+  http_parser_span fragment;
+  unsigned int num_headers;
+  /* 1 = there were more than max_headers headers; the rest were dropped */
+  unsigned char headers_dropped;
+
+  /** PRIVATE **/
+  unsigned char last;
 };
 
 
@@ -175,6 +225,21 @@ int http_should_keep_alive(http_parser *parser);
 /* Returns a string version of the HTTP method. */
 const char *http_method_str(enum http_method);
 
+/* Vector instructions the parser may use to skip over runs of plain URL
+ * and header value bytes. The best one the CPU supports is used unless
+ * http_parser_set_simd() says otherwise.
+ */
+enum http_parser_simd
+  { HTTP_PARSER_SIMD_NONE = 0
+  , HTTP_PARSER_SIMD_SSE42
+  , HTTP_PARSER_SIMD_AVX2
+  };
+
+/* Use at most the given level, or less if the CPU lacks it. Returns the
+ * level now in use. Not to be called while other threads are parsing.
+ */
+enum http_parser_simd http_parser_set_simd(enum http_parser_simd level);
+
 #ifdef __cplusplus
 }
 #endif
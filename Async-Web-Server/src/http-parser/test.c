@@ -25,6 +25,7 @@
 #include <stdlib.h> /* rand */
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
 
 #undef TRUE
 #define TRUE 1
@@ -68,6 +69,11 @@ struct message {
 
 static int currently_parsing_eof;
 
+/* Spans recorded by test_message(), where each message starts at raw */
+static http_parser_spans spans;
+static http_parser_header span_headers[MAX_HEADERS];
+static const char *spans_raw;
+
 static struct message messages[5];
 static int num_messages;
 
@@ -1035,6 +1041,46 @@ message_begin_cb (http_parser *p)
   return 0;
 }
 
+static int
+span_eq (const char *prop, http_parser_span span, const char *expected)
+{
+  if (span.len != strlen(expected) ||
+      0 != strncmp(spans_raw + span.off, expected, span.len)) {
+    printf("\n*** Error: span of %s ***\n\n", prop);
+    printf("expected '%s'\n", expected);
+    printf("   found '%.*s'\n", (int)span.len, spans_raw + span.off);
+    return 0;
+  }
+  return 1;
+}
+
+/* The spans must tell what the data callbacks told, piece by piece */
+static int
+spans_eq (const struct message *m)
+{
+  int i;
+
+  if (parser->type == HTTP_REQUEST &&
+      !span_eq("method", spans.method, http_method_str(parser->method))) {
+    return 0;
+  }
+  if (!span_eq("url", spans.url, m->request_url)) return 0;
+  if (!span_eq("path", spans.path, m->request_path)) return 0;
+  if (!span_eq("query_string", spans.query_string, m->query_string)) return 0;
+  if (!span_eq("fragment", spans.fragment, m->fragment)) return 0;
+
+  if ((int)spans.num_headers != m->num_headers) {
+    printf("\n*** Error: %u header spans, %d headers ***\n\n",
+           spans.num_headers, m->num_headers);
+    return 0;
+  }
+  for (i = 0; i < m->num_headers; i++) {
+    if (!span_eq("header name", span_headers[i].name, m->headers[i][0])) return 0;
+    if (!span_eq("header value", span_headers[i].value, m->headers[i][1])) return 0;
+  }
+  return 1;
+}
+
 int
 headers_complete_cb (http_parser *p)
 {
@@ -1045,6 +1091,7 @@ headers_complete_cb (http_parser *p)
   messages[num_messages].http_minor = parser->http_minor;
   messages[num_messages].headers_complete_cb_called = TRUE;
   messages[num_messages].should_keep_alive = http_should_keep_alive(parser);
+  if (parser->spans && !spans_eq(&messages[num_messages])) exit(1);
   return 0;
 }
 
@@ -1277,6 +1324,11 @@ test_message (const struct message *message)
   for (msg1len = 0; msg1len < raw_len; msg1len++) {
     parser_init(message->type);
 
+    spans.headers = span_headers;
+    spans.max_headers = MAX_HEADERS;
+    spans_raw = message->raw;
+    parser->spans = &spans;
+
     size_t read;
     const char *msg1 = message->raw;
     const char *msg2 = msg1 + msg1len;
@@ -1646,19 +1698,128 @@ create_large_chunked_message (int body_size_in_kb, const char* headers)
   return buf;
 }
 
+static const char *simd_level_names[] = { "scalar", "sse4.2", "avx2" };
 
-int
-main (void)
+/* Append len bytes cycling through a URL/header safe alphabet. */
+static size_t
+fill_run (char *buf, size_t len)
 {
-  parser = NULL;
-  int i, j, k;
-  int request_count;
-  int response_count;
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789-_=&%";
+  size_t i;
 
-  printf("sizeof(http_parser) = %u\n", (unsigned int)sizeof(http_parser));
+  for (i = 0; i < len; i++)
+    buf[i] = alphabet[i % (sizeof(alphabet) - 1)];
+  return len;
+}
 
-  for (request_count = 0; requests[request_count].name; request_count++);
-  for (response_count = 0; responses[response_count].name; response_count++);
+// user required to free the result
+// string terminated by \0
+/* A browser-like request whose URL and header values are long runs: a
+ * 1 KB path and query string, a long user agent, a 2 KB cookie and a
+ * 512 byte referer.
+ */
+char *
+create_long_request (void)
+{
+  size_t bufsize = 8192;
+  char *buf = malloc(bufsize);
+  size_t wrote = 0;
+
+#define PUT(s) (memcpy(buf + wrote, s, sizeof(s) - 1), wrote += sizeof(s) - 1)
+  PUT("GET /search/");
+  wrote += fill_run(buf + wrote, 512);
+  PUT("?q=");
+  wrote += fill_run(buf + wrote, 512);
+  PUT(" HTTP/1.1\r\nHost: www.example.com\r\nUser-Agent: ");
+  wrote += fill_run(buf + wrote, 256);
+  PUT("\r\nAccept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8"
+      "\r\nAccept-Language: en-US,en;q=0.5\r\nCookie: ");
+  wrote += fill_run(buf + wrote, 2048);
+  PUT("\r\nReferer: https://www.example.com/");
+  wrote += fill_run(buf + wrote, 512);
+  PUT("\r\nConnection: keep-alive\r\n\r\n");
+#undef PUT
+
+  assert(wrote < bufsize);
+  buf[wrote] = '\0';
+
+  return buf;
+}
+
+/* Parse msgs back to back, many times over. Returns the seconds taken and
+ * the bytes parsed in *bytes.
+ */
+static double
+bench_run (const char **msgs, int count, int rounds, size_t *bytes)
+{
+  http_parser p;
+  struct timespec start, end;
+  size_t raw_len;
+  int i, r;
+
+  *bytes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < count; i++) {
+      raw_len = strlen(msgs[i]);
+      http_parser_init(&p, HTTP_REQUEST);
+      http_parser_execute(&p, &settings_null, msgs[i], raw_len);
+      *bytes += raw_len;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Parse the request samples, then a long browser-like request, many times
+ * over, once with each scanner level the CPU has. Run as
+ * "test_fast bench [rounds]".
+ */
+void
+bench (int rounds)
+{
+  const char *samples[sizeof(requests) / sizeof(requests[0])];
+  const char *long_request;
+  enum http_parser_simd level, got;
+  http_parser p;
+  size_t bytes;
+  double secs;
+  int count;
+
+  for (count = 0; requests[count].name; count++)
+    samples[count] = requests[count].raw;
+  long_request = create_long_request();
+  http_parser_init(&p, HTTP_REQUEST);
+  bytes = http_parser_execute(&p, &settings_null, long_request, strlen(long_request));
+  assert(bytes == strlen(long_request));
+
+  for (level = HTTP_PARSER_SIMD_NONE; level <= HTTP_PARSER_SIMD_AVX2; level++) {
+    got = http_parser_set_simd(level);
+    if (got != level) {
+      printf("%-8s not supported\n", simd_level_names[level]);
+      continue;
+    }
+
+    secs = bench_run(samples, count, rounds, &bytes);
+    printf("%-8s samples %8.1f MB/s %10.0f req/s\n", simd_level_names[level],
+           bytes / secs / (1024 * 1024), rounds * count / secs);
+
+    secs = bench_run(&long_request, 1, rounds, &bytes);
+    printf("%-8s long    %8.1f MB/s %10.0f req/s\n", simd_level_names[level],
+           bytes / secs / (1024 * 1024), rounds / secs);
+  }
+
+  http_parser_set_simd(HTTP_PARSER_SIMD_AVX2);
+  free((char *)long_request);
+}
+
+
+/* Run every response and request test with the scanner level set. */
+void
+run_tests (int request_count, int response_count)
+{
+  int i, j, k;
 
   //// OVERFLOW CONDITIONS
 
@@ -1869,6 +2030,37 @@ main (void)
            );
 
   puts("requests okay");
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum http_parser_simd level;
+  parser = NULL;
+  int request_count;
+  int response_count;
+
+  if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+    bench(argc > 2 ? atoi(argv[2]) : 200000);
+    return 0;
+  }
+
+  printf("sizeof(http_parser) = %u\n", (unsigned int)sizeof(http_parser));
+
+  for (request_count = 0; requests[request_count].name; request_count++);
+  for (response_count = 0; responses[response_count].name; response_count++);
+
+  /* Every scanner the CPU has must pass the same vectors and scans. */
+  for (level = HTTP_PARSER_SIMD_NONE; level <= HTTP_PARSER_SIMD_AVX2; level++) {
+    if (http_parser_set_simd(level) != level) {
+      printf("%s scanner not supported, skipped\n", simd_level_names[level]);
+      continue;
+    }
+    printf("%s scanner\n", simd_level_names[level]);
+    run_tests(request_count, response_count);
+  }
+
+  http_parser_set_simd(HTTP_PARSER_SIMD_AVX2);
 
   return 0;
 }
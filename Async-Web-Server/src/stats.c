@@ -0,0 +1,90 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <time.h>
+
+#include "stats.h"
+
+uint64_t stats_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static unsigned int stats_hist_index(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < STATS_HIST_SUB_COUNT)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	if (e >= STATS_HIST_MAX_BITS)
+		return STATS_HIST_BUCKETS - 1;
+
+	return (e - STATS_HIST_SUB_BITS + 1) * STATS_HIST_SUB_COUNT +
+		((v >> (e - STATS_HIST_SUB_BITS)) & (STATS_HIST_SUB_COUNT - 1));
+}
+
+static uint64_t stats_hist_value(unsigned int index)
+{
+	/* Upper bound of the values counted in a bucket. */
+	unsigned int e, sub;
+
+	if (index < STATS_HIST_SUB_COUNT)
+		return index;
+
+	e = index / STATS_HIST_SUB_COUNT + STATS_HIST_SUB_BITS - 1;
+	sub = index % STATS_HIST_SUB_COUNT;
+
+	return ((uint64_t)(STATS_HIST_SUB_COUNT + sub + 1) << (e - STATS_HIST_SUB_BITS)) - 1;
+}
+
+/* Called by the owner of the histogram only. */
+
+void stats_hist_record(struct stats_histogram *h, uint64_t v)
+{
+	STATS_INC(h->buckets[stats_hist_index(v)]);
+	STATS_INC(h->count);
+	if (v > h->max)
+		STATS_SET(h->max, v);
+}
+
+/* Add a histogram that another thread may be recording into. */
+
+void stats_hist_merge(struct stats_histogram *dst, const struct stats_histogram *src)
+{
+	uint64_t max = STATS_READ(src->max);
+	unsigned int i;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++)
+		dst->buckets[i] += STATS_READ(src->buckets[i]);
+	dst->count += STATS_READ(src->count);
+	if (max > dst->max)
+		dst->max = max;
+}
+
+uint64_t stats_hist_percentile(const struct stats_histogram *h, double p)
+{
+	uint64_t target = (uint64_t)(h->count * p / 100.0 + 0.5);
+	uint64_t seen = 0;
+	uint64_t value;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target) {
+			value = stats_hist_value(i);
+			return value < h->max ? value : h->max;
+		}
+	}
+
+	return h->max;
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef STATS_H_
+#define STATS_H_	1
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Statistics are written by the thread that owns them only, and read by
+ * any thread. Relaxed atomic accesses keep the readers free of torn values
+ * while both sides still compile to plain loads and stores: no counter is
+ * ever shared between writers, so nothing needs a lock or a locked
+ * instruction.
+ */
+#define STATS_READ(var)		__atomic_load_n(&(var), __ATOMIC_RELAXED)
+#define STATS_SET(var, v)	__atomic_store_n(&(var), (v), __ATOMIC_RELAXED)
+#define STATS_ADD(var, n)	STATS_SET(var, (var) + (n))
+#define STATS_INC(var)		STATS_ADD(var, 1)
+#define STATS_DEC(var)		STATS_SET(var, (var) - 1)
+
+/*
+ * Histogram of microsecond values with HDR-style buckets: values below
+ * 2^STATS_HIST_SUB_BITS are exact, larger ones fall in one of
+ * 2^STATS_HIST_SUB_BITS buckets per power of two, which bounds the error
+ * to about 3% over the whole range.
+ */
+#define STATS_HIST_SUB_BITS	5
+#define STATS_HIST_SUB_COUNT	(1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_MAX_BITS	36
+#define STATS_HIST_BUCKETS	((STATS_HIST_MAX_BITS - STATS_HIST_SUB_BITS + 1) * STATS_HIST_SUB_COUNT)
+
+struct stats_histogram {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+uint64_t stats_now_us(void);
+void stats_hist_record(struct stats_histogram *h, uint64_t v);
+void stats_hist_merge(struct stats_histogram *dst, const struct stats_histogram *src);
+uint64_t stats_hist_percentile(const struct stats_histogram *h, double p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATS_H_ */
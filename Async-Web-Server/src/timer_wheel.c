@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stddef.h>
+
+#include "timer_wheel.h"
+
+void timer_wheel_init(struct timer_wheel *tw, unsigned long now)
+{
+	unsigned int i;
+
+	for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		tw->slots[i].next = &tw->slots[i];
+		tw->slots[i].prev = &tw->slots[i];
+	}
+	tw->now = now;
+	tw->count = 0;
+}
+
+void timer_wheel_del(struct timer_wheel *tw, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	timer_init(t);
+	tw->count--;
+}
+
+/* Arm t, or move it if already armed, to fire at tick expires. */
+
+void timer_wheel_add(struct timer_wheel *tw, struct timer *t, unsigned long expires)
+{
+	struct timer *slot;
+
+	timer_wheel_del(tw, t);
+
+	/* A deadline already passed fires on the next tick. */
+	if (expires <= tw->now)
+		expires = tw->now + 1;
+
+	slot = &tw->slots[expires & (TIMER_WHEEL_SLOTS - 1)];
+	t->expires = expires;
+	t->next = slot;
+	t->prev = slot->prev;
+	slot->prev->next = t;
+	slot->prev = t;
+	tw->count++;
+}
+
+/*
+ * Advance the wheel to tick now, calling expire on every timer due by then.
+ * The timer is disarmed before the call, which may free its owner.
+ */
+
+void timer_wheel_expire(struct timer_wheel *tw, unsigned long now,
+			void (*expire)(struct timer *t))
+{
+	unsigned long tick;
+	unsigned long last = now;
+	struct timer *slot;
+	struct timer *t;
+	struct timer *next;
+
+	/* After a long stall, one turn visits every slot. */
+	if (now - tw->now > TIMER_WHEEL_SLOTS)
+		last = tw->now + TIMER_WHEEL_SLOTS;
+
+	for (tick = tw->now + 1; tick <= last && tw->count > 0; tick++) {
+		slot = &tw->slots[tick & (TIMER_WHEEL_SLOTS - 1)];
+		for (t = slot->next; t != slot; t = next) {
+			next = t->next;
+			if (t->expires > now)
+				continue;
+			timer_wheel_del(tw, t);
+			expire(t);
+		}
+	}
+
+	tw->now = now;
+}
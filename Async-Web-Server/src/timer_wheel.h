@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* slots of the wheel; a power of two keeps the hashing a mask */
+#define TIMER_WHEEL_SLOTS	256
+
+/*
+ * Timer embedded in the object it expires. Deadlines are counted in ticks
+ * of the wheel's clock; an unarmed timer has no links.
+ */
+struct timer {
+	struct timer *next;
+	struct timer *prev;
+	unsigned long expires;
+};
+
+/*
+ * Hashed timer wheel: a timer lives in the slot its deadline hashes to, so
+ * arming, re-arming and cancelling are O(1). Every tick visits one slot;
+ * deadlines more than a turn away stay in their slot until their turn.
+ */
+struct timer_wheel {
+	struct timer slots[TIMER_WHEEL_SLOTS];
+	unsigned long now;
+	unsigned int count;
+};
+
+static inline void timer_init(struct timer *t)
+{
+	t->next = NULL;
+	t->prev = NULL;
+}
+
+static inline int timer_pending(const struct timer *t)
+{
+	return t->next != NULL;
+}
+
+void timer_wheel_init(struct timer_wheel *tw, unsigned long now);
+void timer_wheel_add(struct timer_wheel *tw, struct timer *t, unsigned long expires);
+void timer_wheel_del(struct timer_wheel *tw, struct timer *t);
+void timer_wheel_expire(struct timer_wheel *tw, unsigned long now,
+			void (*expire)(struct timer *t));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TIMER_WHEEL_H_ */
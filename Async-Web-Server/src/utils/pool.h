@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef POOL_H_
+#define POOL_H_		1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+
+/*
+ * Free list of fixed size objects. Objects are never given back to the
+ * allocator: a released one is handed out again by the next pool_get().
+ * The first word of a free object links it to the next one.
+ */
+struct pool {
+	size_t size;
+	void *free;
+};
+
+static inline void pool_put(struct pool *p, void *obj)
+{
+	*(void **)obj = p->free;
+	p->free = obj;
+}
+
+/* Set up the pool with count objects carved from one allocation. */
+static inline int pool_init(struct pool *p, size_t size, unsigned int count)
+{
+	char *chunk;
+	unsigned int i;
+
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	p->size = size;
+	p->free = NULL;
+
+	if (count == 0)
+		return 0;
+
+	chunk = malloc(size * count);
+	if (chunk == NULL)
+		return -1;
+
+	for (i = count; i > 0; i--)
+		pool_put(p, chunk + (size_t)(i - 1) * size);
+
+	return 0;
+}
+
+/* Returns an uninitialized object, or NULL if memory ran out. */
+static inline void *pool_get(struct pool *p)
+{
+	void *obj = p->free;
+
+	if (obj == NULL)
+		return malloc(p->size);
+
+	p->free = *(void **)obj;
+	return obj;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POOL_H_ */
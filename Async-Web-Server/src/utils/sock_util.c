@@ -59,7 +59,9 @@ int tcp_close_connection(int sockfd)
 }
 
 /*
- * Create a server socket.
+ * Create a server socket. SO_REUSEPORT allows several listeners (one per
+ * event loop thread) to bind the same port; the kernel balances incoming
+ * connections between them.
  */
 
 int tcp_create_listener(unsigned short port, int backlog)
@@ -77,6 +79,10 @@ int tcp_create_listener(unsigned short port, int backlog)
 				&sock_opt, sizeof(int));
 	DIE(rc < 0, "setsockopt");
 
+	rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+				&sock_opt, sizeof(int));
+	DIE(rc < 0, "setsockopt");
+
 	memset(&address, 0, sizeof(address));
 	address.sin_family = AF_INET;
 	address.sin_port = htons(port);
@@ -151,6 +151,36 @@ static inline int w_epoll_update_ptr_inout(int epollfd, int fd, void *ptr)
 	return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
 }
 
+static inline int w_epoll_add_ptr_in_et(int epollfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static inline int w_epoll_update_ptr_in_et(int epollfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static inline int w_epoll_update_ptr_out_et(int epollfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLOUT | EPOLLET;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
 static inline int w_epoll_remove_ptr(int epollfd, int fd, void *ptr)
 {
 	struct epoll_event ev;
@@ -170,6 +200,22 @@ static inline int w_epoll_wait_infinite(int epollfd, struct epoll_event *rev)
 {
 	return epoll_wait(epollfd, rev, 1, EPOLL_TIMEOUT_INFINITE);
 }
+
+/*
+ * Wait for up to maxevents ready descriptors in a single system call.
+ * Returns the number of entries filled in revs.
+ */
+static inline int w_epoll_wait_batch(int epollfd, struct epoll_event *revs,
+				     int maxevents, int timeout)
+{
+	return epoll_wait(epollfd, revs, maxevents, timeout);
+}
+
+static inline int w_epoll_wait_batch_infinite(int epollfd, struct epoll_event *revs,
+					      int maxevents)
+{
+	return w_epoll_wait_batch(epollfd, revs, maxevents, EPOLL_TIMEOUT_INFINITE);
+}
 #ifdef __cplusplus
 }
 #endif
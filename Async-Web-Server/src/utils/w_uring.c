@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "w_uring.h"
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode,
+				 const void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Create a ring with room for the given number of submissions and map its
+ * queues. Returns 0 on success, -1 with errno set otherwise.
+ */
+
+int w_uring_setup(struct w_uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq;
+	char *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto close_fd;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			goto unmap_sq;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_entries = (unsigned int *)(sq + p.sq_off.ring_entries);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_size);
+close_fd:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+void w_uring_destroy(struct w_uring *ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/*
+ * Return a cleared submission entry, or NULL if the queue is full and has
+ * to be submitted first. The entry is handed to the kernel by the next
+ * w_uring_submit_and_wait().
+ */
+
+struct io_uring_sqe *w_uring_get_sqe(struct w_uring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int index;
+	struct io_uring_sqe *sqe;
+
+	if (ring->sq_local_tail - head >= *ring->sq_entries)
+		return NULL;
+
+	index = ring->sq_local_tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+
+	return sqe;
+}
+
+/*
+ * Publish the filled entries and, in the same system call, wait until at
+ * least wait_nr completions are available.
+ */
+
+int w_uring_submit_and_wait(struct w_uring *ring, unsigned int wait_nr)
+{
+	unsigned int to_submit;
+	int rc;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (to_submit == 0 && wait_nr == 0)
+		return 0;
+
+	do {
+		rc = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+					wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (rc < 0 && errno == EINTR && wait_nr == 0);
+
+	return rc;
+}
+
+struct io_uring_cqe *w_uring_peek_cqe(struct w_uring *ring)
+{
+	unsigned int head = *ring->cq_head;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void w_uring_cqe_seen(struct w_uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int w_uring_register_buffers(struct w_uring *ring, const struct iovec *iov, unsigned int nr)
+{
+	return sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, nr);
+}
+
+int w_uring_register_files(struct w_uring *ring, const int *fds, unsigned int nr)
+{
+	return sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, fds, nr);
+}
+
+/* Point a registered file slot to fd, or empty it when fd is -1. */
+
+int w_uring_update_file(struct w_uring *ring, unsigned int slot, int fd)
+{
+	struct io_uring_files_update up;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds = (unsigned long)&fd;
+
+	return sys_io_uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef W_URING_H_
+#define W_URING_H_	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper on top of the raw system calls: one ring, mapped
+ * submission and completion queues, and the few registration calls the
+ * server needs.
+ */
+struct w_uring {
+	int fd;
+
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_entries;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	/* entries filled but not yet handed to the kernel */
+	unsigned int sq_local_tail;
+
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+int w_uring_setup(struct w_uring *ring, unsigned int entries);
+void w_uring_destroy(struct w_uring *ring);
+
+struct io_uring_sqe *w_uring_get_sqe(struct w_uring *ring);
+int w_uring_submit_and_wait(struct w_uring *ring, unsigned int wait_nr);
+
+struct io_uring_cqe *w_uring_peek_cqe(struct w_uring *ring);
+void w_uring_cqe_seen(struct w_uring *ring);
+
+int w_uring_register_buffers(struct w_uring *ring, const struct iovec *iov, unsigned int nr);
+int w_uring_register_files(struct w_uring *ring, const int *fds, unsigned int nr);
+int w_uring_update_file(struct w_uring *ring, unsigned int slot, int fd);
+
+static inline int w_uring_submit(struct w_uring *ring)
+{
+	return w_uring_submit_and_wait(ring, 0);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* W_URING_H_ */
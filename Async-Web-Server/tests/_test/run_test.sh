@@ -111,7 +111,7 @@ basic_test()
 
 # ----------------- Init and cleanup tests ----------------------------------- #
 
-# Initializes a test
+# Initializes a test, starting the server with the given options
 init_test()
 {
     libpath="$(readlink -f _test/sockop_preload.so)"
@@ -127,7 +127,7 @@ init_test()
         MEMCHECK_TEST=
     fi
 
-    LD_PRELOAD="$libpath" $MEMCHECK_TEST $exec_name &>> "$LOG_FILE" &
+    LD_PRELOAD="$libpath" $MEMCHECK_TEST $exec_name "$@" &>> "$LOG_FILE" &
     if test $? -eq 0; then
         exec_pid=$!
     fi
@@ -825,6 +825,308 @@ test_get_multiple_simultaneous_stat_dyn_files()
     cleanup_test
 }
 
+# Requests served once the caches are warm make no heap allocations
+test_no_allocations_per_request()
+{
+    libpath="$(readlink -f _test/alloc_preload.so)"
+    count_file="$(pwd)/alloc.count"
+    long_name=$(printf "%080d" 0).dat
+    static="http://localhost:8888/$(basename $static_folder)"
+    dynamic="http://localhost:8888/$(basename $dynamic_folder)"
+    urls="$static/small00.dat $static/large00.dat $dynamic/small00.dat \
+        $dynamic/large00.dat $static/abcdef.dat $static/$long_name"
+
+    AWS_ALLOC_COUNT="$count_file" LD_PRELOAD="$libpath" $exec_name &>> "$LOG_FILE" &
+    exec_pid=$!
+    sleep 2
+
+    # One connection per request, then all of them over a persistent one.
+    for _ in $(seq 1 4); do
+        for url in $urls; do
+            wget -t 1 "$url" -o /dev/null -O /dev/null
+        done
+        # shellcheck disable=SC2086
+        wget -t 1 $urls -o /dev/null -O /dev/null
+    done
+    kill -USR2 "$exec_pid"
+    sleep 1
+    before=$(cat "$count_file")
+
+    for _ in $(seq 1 16); do
+        for url in $urls; do
+            wget -t 1 "$url" -o /dev/null -O /dev/null
+        done
+        # shellcheck disable=SC2086
+        wget -t 1 $urls -o /dev/null -O /dev/null
+    done
+    kill -USR2 "$exec_pid"
+    sleep 1
+    after=$(cat "$count_file")
+
+    basic_test test -n "$before" -a "$before" = "$after"
+
+    rm -f "$count_file"
+    cleanup_test
+}
+
+# Second request sent a second later over the same connection
+test_keep_alive()
+{
+    init_test
+
+    {
+        echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.1\r\n\r\n"
+        sleep 1
+        echo -ne "GET /$(basename $static_folder)/small01.dat HTTP/1.1\r\nConnection: close\r\n\r\n"
+    } | nc -q 1 localhost "$aws_listen_port" > small01.dat 2> /dev/null
+
+    n_replies=$(grep -a -o 'HTTP/1.1 200 OK' small01.dat | wc -l)
+    tail -c 2048 small01.dat | cmp - $static_folder/small01.dat > /dev/null 2>&1
+    basic_test test $? -eq 0 -a "$n_replies" -eq 2
+
+    rm small01.dat
+    cleanup_test
+}
+
+# Both requests sent at once, answered in order
+test_pipelined_requests()
+{
+    init_test
+
+    echo -ne "GET /$(basename $dynamic_folder)/small00.dat HTTP/1.1\r\n\r\nGET /$(basename $static_folder)/small01.dat HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > small01.dat 2> /dev/null
+
+    n_replies=$(grep -a -o 'HTTP/1.1 200 OK' small01.dat | wc -l)
+    tail -c 2048 small01.dat | cmp - $static_folder/small01.dat > /dev/null 2>&1
+    basic_test test $? -eq 0 -a "$n_replies" -eq 2
+
+    rm small01.dat
+    cleanup_test
+}
+
+test_range_206()
+{
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.0\r\nRange: bytes=100-199\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > small00.dat 2> /dev/null
+
+    head -1 small00.dat | grep '^HTTP/1.1 206' > /dev/null 2>&1
+    code1=$?
+    grep -a 'Content-Range: bytes 100-199/2048' small00.dat > /dev/null 2>&1
+    code2=$?
+    tail -c 100 small00.dat | cmp - <(tail -c +101 $static_folder/small00.dat | head -c 100) > /dev/null 2>&1
+    code3=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0 -a "$code3" -eq 0
+
+    rm small00.dat
+    cleanup_test
+}
+
+# Two ranges of a dynamic file, as multipart/byteranges parts
+test_range_multipart_206()
+{
+    init_test
+
+    echo -ne "GET /$(basename $dynamic_folder)/large00.dat HTTP/1.0\r\nRange: bytes=0-9,1048576-1048585\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > large00.dat 2> /dev/null
+
+    head -1 large00.dat | grep '^HTTP/1.1 206' > /dev/null 2>&1
+    code1=$?
+    grep -a 'Content-Type: multipart/byteranges' large00.dat > /dev/null 2>&1
+    code2=$?
+    part_header="Content-Range: bytes 1048576-1048585/2097152"
+    offset=$(grep -a -b -o "$part_header" large00.dat | cut -d: -f1)
+    tail -c +$((offset + ${#part_header} + 5)) large00.dat | head -c 10 | \
+        cmp - <(tail -c +1048577 $dynamic_folder/large00.dat | head -c 10) > /dev/null 2>&1
+    code3=$?
+    basic_test test -n "$offset" -a "$code1" -eq 0 -a "$code2" -eq 0 -a "$code3" -eq 0
+
+    rm large00.dat
+    cleanup_test
+}
+
+test_range_not_satisfiable_416()
+{
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.0\r\nRange: bytes=5000-\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > small00.dat 2> /dev/null
+
+    head -1 small00.dat | grep '^HTTP/1.1 416' > /dev/null 2>&1
+    code1=$?
+    grep -a 'Content-Range: bytes \*/2048' small00.dat > /dev/null 2>&1
+    basic_test test "$code1" -eq 0 -a $? -eq 0
+
+    rm small00.dat
+    cleanup_test
+}
+
+# Revalidate with the ETag of a first reply
+test_if_none_match_304()
+{
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.0\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > small00.dat 2> /dev/null
+    etag=$(grep -a '^ETag: ' small00.dat | cut -d ' ' -f 2 | tr -d '\r')
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.0\r\nIf-None-Match: $etag\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > small00.dat 2> /dev/null
+
+    head -1 small00.dat | grep '^HTTP/1.1 304' > /dev/null 2>&1
+    basic_test test -n "$etag" -a $? -eq 0
+
+    rm small00.dat
+    cleanup_test
+}
+
+# Revalidate with the Last-Modified date of a first reply
+test_if_modified_since_304()
+{
+    init_test
+
+    echo -ne "GET /$(basename $dynamic_folder)/large00.dat HTTP/1.0\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > large00.dat 2> /dev/null
+    last_modified=$(grep -a '^Last-Modified: ' large00.dat | cut -d ' ' -f 2- | tr -d '\r')
+
+    echo -ne "GET /$(basename $dynamic_folder)/large00.dat HTTP/1.0\r\nIf-Modified-Since: $last_modified\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > large00.dat 2> /dev/null
+
+    head -1 large00.dat | grep '^HTTP/1.1 304' > /dev/null 2>&1
+    basic_test test -n "$last_modified" -a $? -eq 0
+
+    rm large00.dat
+    cleanup_test
+}
+
+# A client accepting gzip gets the precompressed file next to the original
+test_accept_encoding_gzip()
+{
+    gzip -c $static_folder/small00.dat > $static_folder/small00.dat.gz
+    gz_size=$(wc -c < $static_folder/small00.dat.gz)
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.0\r\nAccept-Encoding: gzip\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > small00.dat 2> /dev/null
+
+    grep -a 'Content-Encoding: gzip' small00.dat > /dev/null 2>&1
+    code1=$?
+    grep -a 'Vary: Accept-Encoding' small00.dat > /dev/null 2>&1
+    code2=$?
+    tail -c "$gz_size" small00.dat | cmp - $static_folder/small00.dat.gz > /dev/null 2>&1
+    code3=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0 -a "$code3" -eq 0
+
+    rm small00.dat $static_folder/small00.dat.gz
+    cleanup_test
+}
+
+# Without Accept-Encoding the original is sent, still with Vary
+test_accept_encoding_identity()
+{
+    gzip -c $static_folder/small00.dat > $static_folder/small00.dat.gz
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.0\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > small00.dat 2> /dev/null
+
+    grep -a 'Content-Encoding' small00.dat > /dev/null 2>&1
+    code1=$?
+    grep -a 'Vary: Accept-Encoding' small00.dat > /dev/null 2>&1
+    code2=$?
+    tail -c 2048 small00.dat | cmp - $static_folder/small00.dat > /dev/null 2>&1
+    code3=$?
+    basic_test test "$code1" -ne 0 -a "$code2" -eq 0 -a "$code3" -eq 0
+
+    rm small00.dat $static_folder/small00.dat.gz
+    cleanup_test
+}
+
+# Generated bodies are sent in chunks to HTTP/1.1 clients
+test_handler_chunked()
+{
+    init_test -g
+
+    echo -ne "GET /stream/lines/3 HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > lines.txt 2> /dev/null
+
+    expected="15\r\nline 1\nline 2\nline 3\n\r\n0\r\n\r\n"
+    grep -a 'Transfer-Encoding: chunked' lines.txt > /dev/null 2>&1
+    code1=$?
+    tail -c 32 lines.txt | cmp - <(echo -ne "$expected") > /dev/null 2>&1
+    code2=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0
+
+    rm lines.txt
+    cleanup_test
+}
+
+# and as they are, ended by closing the connection, to HTTP/1.0 clients
+test_handler_http_1_0()
+{
+    init_test -g
+
+    echo -ne "GET /stream/lines/3 HTTP/1.0\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > lines.txt 2> /dev/null
+
+    grep -a 'Transfer-Encoding' lines.txt > /dev/null 2>&1
+    code1=$?
+    tail -c 22 lines.txt | cmp - <(echo -ne "\nline 1\nline 2\nline 3\n") > /dev/null 2>&1
+    code2=$?
+    basic_test test "$code1" -ne 0 -a "$code2" -eq 0
+
+    rm lines.txt
+    cleanup_test
+}
+
+# A connection that never sends a request is closed after 15 seconds
+test_idle_timeout()
+{
+    init_test
+
+    nc localhost "$aws_listen_port" 0<&- &
+    nc_pid=$!
+    sleep 1
+
+    n_conns=$(lsof -p "$exec_pid" | awk -F '[ \t]+' '{print $8, $10;}' | \
+        grep TCP | grep -c ESTABLISHED 2> /dev/null)
+    sleep 16
+
+    lsof -p "$exec_pid" | awk -F '[ \t]+' '{print $8, $10;}' | grep TCP | \
+        grep ESTABLISHED > /dev/null 2>&1
+    basic_test test "$n_conns" -eq 1 -a $? -ne 0
+
+    kill -9 "$nc_pid" > /dev/null 2>&1
+    wait "$nc_pid" > /dev/null 2>&1
+
+    cleanup_test
+}
+
+# A request not received whole within 10 seconds of its first byte is dropped
+test_request_timeout()
+{
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.1\r\n" | \
+        nc -q 30 localhost "$aws_listen_port" > /dev/null 2>&1 &
+    nc_pid=$!
+    sleep 1
+
+    n_conns=$(lsof -p "$exec_pid" | awk -F '[ \t]+' '{print $8, $10;}' | \
+        grep TCP | grep -c ESTABLISHED 2> /dev/null)
+    sleep 11
+
+    lsof -p "$exec_pid" | awk -F '[ \t]+' '{print $8, $10;}' | grep TCP | \
+        grep ESTABLISHED > /dev/null 2>&1
+    basic_test test "$n_conns" -eq 1 -a $? -ne 0
+
+    kill -9 "$nc_pid" > /dev/null 2>&1
+    wait "$nc_pid" > /dev/null 2>&1
+
+    cleanup_test
+}
+
 # Specifies the tests, commands and points
 test_fun_array=( \
     test_executable_exists "Test executable exists" 1 0
@@ -862,6 +1164,20 @@ test_get_two_simultaneous_dyn_files "Test get two simultaneous dynamic files" 4
 test_get_multiple_simultaneous_dyn_files "Test get multiple simultaneous dynamic files" 5 1
 test_get_two_simultaneous_stat_dyn_files "Test get two simultaneous static and dynamic files" 3 1
 test_get_multiple_simultaneous_stat_dyn_files "Test get multiple simultaneous static and dynamic files" 4 1
+test_no_allocations_per_request "Test no heap allocations per request" 0 0
+test_keep_alive "Test keep-alive connection" 0 0
+test_pipelined_requests "Test pipelined requests" 0 0
+test_range_206 "Test range request 206" 0 0
+test_range_multipart_206 "Test multiple range request 206" 0 0
+test_range_not_satisfiable_416 "Test unsatisfiable range 416" 0 0
+test_if_none_match_304 "Test If-None-Match 304" 0 0
+test_if_modified_since_304 "Test If-Modified-Since 304" 0 0
+test_accept_encoding_gzip "Test Accept-Encoding gzip variant" 0 0
+test_accept_encoding_identity "Test Accept-Encoding identity" 0 0
+test_handler_chunked "Test chunked generated body" 0 0
+test_handler_http_1_0 "Test generated body for HTTP/1.0" 0 0
+test_idle_timeout "Test idle connection timeout" 0 0
+test_request_timeout "Test slow request timeout" 0 0
 )
 
 # ---------------------------------------------------------------------------- #
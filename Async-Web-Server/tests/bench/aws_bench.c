@@ -0,0 +1,679 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * Load generator for the asynchronous web server.
+ *
+ * Each thread drives its share of the connections from its own epoll
+ * instance. In closed loop mode (the default) a connection sends its next
+ * request as soon as the previous response is complete. In open loop mode
+ * (-r) requests are due at a fixed aggregate rate whether or not the server
+ * keeps up; latency is then measured from the time a request was due, not
+ * from the time it could be sent, so a stalled server is not hidden by a
+ * stalled client.
+ *
+ * With -k every connection is kept alive; without it each request goes
+ * out on a fresh connection with "Connection: close".
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "utils/util.h"
+#include "utils/w_epoll.h"
+
+#define BENCH_MAX_PATHS		16
+#define BENCH_MAX_THREADS	64
+#define BENCH_EPOLL_BATCH	256
+#define BENCH_RECV_SIZE		(256 * 1024)
+#define BENCH_HEADER_MAX	4096
+/* requests an open loop connection may fall behind by before dropping some */
+#define BENCH_BACKLOG		1024
+
+/*
+ * Latency histogram in microseconds with HDR-style buckets: values below
+ * 2^HIST_SUB_BITS are exact, larger ones fall in one of 2^HIST_SUB_BITS
+ * buckets per power of two, which bounds the error to about 3%.
+ */
+#define HIST_SUB_BITS		5
+#define HIST_SUB_COUNT		(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS		40
+#define HIST_BUCKETS		((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+enum bench_conn_state {
+	BENCH_IDLE,
+	BENCH_CONNECTING,
+	BENCH_SENDING,
+	BENCH_RECEIVING
+};
+
+struct bench_conn {
+	int fd;
+	enum bench_conn_state state;
+	unsigned int path;
+	/* a request is waiting for the connect in progress to finish */
+	int queued;
+
+	/* request being sent, and whether EPOLLOUT is armed to finish it */
+	size_t req_pos;
+	int want_out;
+
+	/* response being received; body_left is -1 until the header is in */
+	char header[BENCH_HEADER_MAX];
+	size_t header_len;
+	long body_left;
+	int close_after;
+
+	/* when the current request was due, and requests due since */
+	uint64_t due;
+	uint64_t next_due;
+	unsigned int backlog;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	int epollfd;
+	struct bench_conn *conns;
+	unsigned int nconns;
+
+	/* results */
+	struct histogram latency;
+	uint64_t requests;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t dropped;
+	uint64_t status[6];
+};
+
+/* command line options */
+static const char *host = "127.0.0.1";
+static unsigned short port = 8888;
+static unsigned int num_conns = 16;
+static unsigned int num_threads = 1;
+static double duration = 10;
+static double rate;
+static int keep_alive;
+static const char *paths[BENCH_MAX_PATHS];
+static unsigned int num_paths;
+
+/* address of the server, resolved once */
+static struct sockaddr_in server_addr;
+
+/* pre-formatted requests, one per path */
+static char *requests[BENCH_MAX_PATHS];
+static size_t request_lens[BENCH_MAX_PATHS];
+
+/* nanoseconds between two requests of one connection, in open loop mode */
+static uint64_t interval;
+static uint64_t start_time;
+static uint64_t end_time;
+
+static struct bench_thread threads[BENCH_MAX_THREADS];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < HIST_SUB_COUNT)
+		return v;
+
+	e = 63 - __builtin_clzll(v);
+	if (e >= HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB_COUNT +
+		((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1));
+}
+
+static uint64_t hist_value(unsigned int index)
+{
+	/* Upper bound of the values counted in a bucket. */
+	unsigned int e, sub;
+
+	if (index < HIST_SUB_COUNT)
+		return index;
+
+	e = index / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+	sub = index % HIST_SUB_COUNT;
+
+	return ((uint64_t)(HIST_SUB_COUNT + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_record(struct histogram *h, uint64_t v)
+{
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double p)
+{
+	uint64_t target = (uint64_t)(h->count * p / 100.0 + 0.5);
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			return hist_value(i) < h->max ? hist_value(i) : h->max;
+	}
+
+	return h->max;
+}
+
+static void bench_connect(struct bench_thread *t, struct bench_conn *c)
+{
+	/*
+	 * Start connecting without waiting for the handshake, which only holds
+	 * up this connection: EPOLLOUT reports when it is over.
+	 */
+	int rc;
+
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	DIE(c->fd < 0, "socket");
+
+	rc = connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+	DIE(rc < 0 && errno != EINPROGRESS, "connect");
+
+	rc = w_epoll_add_ptr_inout(t->epollfd, c->fd, c);
+	DIE(rc < 0, "w_epoll_add_ptr_inout");
+	c->want_out = 1;
+	c->queued = 0;
+	c->state = BENCH_CONNECTING;
+}
+
+static void bench_disconnect(struct bench_thread *t, struct bench_conn *c)
+{
+	w_epoll_remove_ptr(t->epollfd, c->fd, c);
+	close(c->fd);
+	c->fd = -1;
+}
+
+static int bench_send(struct bench_thread *t, struct bench_conn *c)
+{
+	/*
+	 * Send what is left of the request. EPOLLOUT is only armed while a
+	 * request does not fit in the socket buffer.
+	 */
+	const char *req = requests[c->path];
+	size_t len = request_lens[c->path];
+	ssize_t n;
+
+	while (c->req_pos < len) {
+		n = send(c->fd, req + c->req_pos, len - c->req_pos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			if (!c->want_out && w_epoll_update_ptr_inout(t->epollfd, c->fd, c) < 0)
+				return -1;
+			c->want_out = 1;
+			return 0;
+		}
+		c->req_pos += n;
+	}
+
+	if (c->want_out && w_epoll_update_ptr_in(t->epollfd, c->fd, c) < 0)
+		return -1;
+	c->want_out = 0;
+	c->state = BENCH_RECEIVING;
+
+	return 0;
+}
+
+static int bench_connected(struct bench_thread *t, struct bench_conn *c)
+{
+	/* The connect is over: send the request waiting for it, if any. */
+	socklen_t len = sizeof(int);
+	int err;
+
+	if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+		return -1;
+
+	if (c->queued) {
+		c->state = BENCH_SENDING;
+		return bench_send(t, c);
+	}
+
+	if (w_epoll_update_ptr_in(t->epollfd, c->fd, c) < 0)
+		return -1;
+	c->want_out = 0;
+	c->state = BENCH_IDLE;
+
+	return 0;
+}
+
+static int bench_can_start(struct bench_conn *c)
+{
+	return c->state == BENCH_IDLE || (c->state == BENCH_CONNECTING && !c->queued);
+}
+
+static void bench_start_request(struct bench_thread *t, struct bench_conn *c, uint64_t due)
+{
+	if (c->fd < 0)
+		bench_connect(t, c);
+
+	c->due = due;
+	c->path = (c->path + 1) % num_paths;
+	c->req_pos = 0;
+	c->header_len = 0;
+	c->body_left = -1;
+	c->close_after = !keep_alive;
+
+	if (c->state == BENCH_CONNECTING) {
+		c->queued = 1;
+		return;
+	}
+	c->state = BENCH_SENDING;
+
+	/* A failed send shows up as a failed receive on the next event. */
+	if (bench_send(t, c) < 0)
+		c->state = BENCH_RECEIVING;
+}
+
+static int bench_parse_header(struct bench_thread *t, struct bench_conn *c)
+{
+	/*
+	 * Look for the end of the response header; once found, note the body
+	 * length and whether the server closes the connection. Returns the
+	 * number of header bytes, or 0 if the header is incomplete.
+	 */
+	char *end, *line;
+	int status;
+
+	c->header[c->header_len] = '\0';
+	end = strstr(c->header, "\r\n\r\n");
+	if (end == NULL)
+		return 0;
+	end += 4;
+
+	if (sscanf(c->header, "HTTP/1.%*d %d", &status) != 1)
+		status = 0;
+	t->status[status >= 100 && status < 600 ? status / 100 : 0]++;
+
+	c->body_left = -1;
+	for (line = strstr(c->header, "\r\n"); line != NULL && line + 2 < end;
+	     line = strstr(line + 2, "\r\n")) {
+		if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+			c->body_left = strtol(line + 17, NULL, 10);
+		else if (strncasecmp(line + 2, "Connection: close", 17) == 0)
+			c->close_after = 1;
+	}
+
+	/* without a length, the body runs to the end of the connection */
+	if (c->body_left < 0) {
+		c->body_left = LONG_MAX;
+		c->close_after = 1;
+	}
+	if (status == 304 || status == 204)
+		c->body_left = 0;
+
+	return end - c->header;
+}
+
+static void bench_complete(struct bench_thread *t, struct bench_conn *c)
+{
+	uint64_t now = now_ns();
+
+	if (now < end_time) {
+		hist_record(&t->latency, (now - c->due) / 1000);
+		t->requests++;
+	}
+
+	if (c->close_after)
+		bench_disconnect(t, c);
+	c->state = BENCH_IDLE;
+
+	if (interval == 0) {
+		bench_start_request(t, c, now);
+	} else if (c->backlog > 0) {
+		c->backlog--;
+		bench_start_request(t, c, c->due + interval);
+	}
+}
+
+static int bench_receive(struct bench_thread *t, struct bench_conn *c, char *buf)
+{
+	ssize_t n;
+	size_t room;
+	int hlen;
+
+	while (c->state == BENCH_RECEIVING) {
+		if (c->body_left < 0) {
+			/* Read the header into the connection, a piece at a time. */
+			room = sizeof(c->header) - 1 - c->header_len;
+			if (room == 0)
+				return -1;
+			n = recv(c->fd, c->header + c->header_len, room, 0);
+		} else {
+			n = recv(c->fd, buf, BENCH_RECV_SIZE, 0);
+		}
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		if (n == 0) {
+			/* end of a body of unknown length */
+			if (c->body_left == LONG_MAX) {
+				c->close_after = 1;
+				bench_complete(t, c);
+				return 0;
+			}
+			return -1;
+		}
+		t->bytes += n;
+
+		if (c->body_left < 0) {
+			c->header_len += n;
+			hlen = bench_parse_header(t, c);
+			if (hlen == 0)
+				continue;
+			/* whatever followed the header belongs to the body */
+			n = c->header_len - hlen;
+		}
+
+		if (c->body_left != LONG_MAX) {
+			if (n > c->body_left)
+				return -1;
+			c->body_left -= n;
+			if (c->body_left == 0)
+				bench_complete(t, c);
+		}
+	}
+
+	return 0;
+}
+
+static void bench_schedule(struct bench_thread *t, uint64_t now)
+{
+	/* Open loop: hand each connection the requests that have come due. */
+	struct bench_conn *c;
+	unsigned int i;
+
+	for (i = 0; i < t->nconns; i++) {
+		c = &t->conns[i];
+		while (c->next_due <= now && c->next_due < end_time) {
+			if (bench_can_start(c) && c->backlog == 0)
+				bench_start_request(t, c, c->next_due);
+			else if (c->backlog < BENCH_BACKLOG)
+				c->backlog++;
+			else
+				t->dropped++;
+			c->next_due += interval;
+		}
+	}
+}
+
+static void *bench_thread_loop(void *arg)
+{
+	struct bench_thread *t = arg;
+	struct epoll_event events[BENCH_EPOLL_BATCH];
+	struct bench_conn *c;
+	uint64_t now;
+	char *buf;
+	int timeout;
+	int rc;
+	int i;
+
+	buf = malloc(BENCH_RECV_SIZE);
+	DIE(buf == NULL, "malloc");
+
+	if (interval == 0)
+		for (i = 0; i < (int)t->nconns; i++)
+			bench_start_request(t, &t->conns[i], now_ns());
+
+	while ((now = now_ns()) < end_time) {
+		if (interval != 0)
+			bench_schedule(t, now);
+
+		timeout = interval != 0 ? 1 : 100;
+		rc = epoll_wait(t->epollfd, events, BENCH_EPOLL_BATCH, timeout);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		DIE(rc < 0, "epoll_wait");
+
+		for (i = 0; i < rc; i++) {
+			c = events[i].data.ptr;
+			if (c->fd < 0)
+				continue;
+			if (c->state == BENCH_CONNECTING && bench_connected(t, c) < 0)
+				goto error;
+			if (c->state == BENCH_SENDING && bench_send(t, c) < 0)
+				goto error;
+			if (c->state == BENCH_RECEIVING && bench_receive(t, c, buf) < 0)
+				goto error;
+			continue;
+error:
+			t->errors++;
+			bench_disconnect(t, c);
+			c->state = BENCH_IDLE;
+			if (interval == 0)
+				bench_start_request(t, c, now_ns());
+		}
+	}
+
+	free(buf);
+
+	return NULL;
+}
+
+static void format_requests(void)
+{
+	unsigned int i;
+	int len;
+
+	for (i = 0; i < num_paths; i++) {
+		len = asprintf(&requests[i],
+			       "GET %s HTTP/1.1\r\n"
+			       "Host: %s\r\n"
+			       "Connection: %s\r\n"
+			       "\r\n",
+			       paths[i], host, keep_alive ? "keep-alive" : "close");
+		DIE(len < 0, "asprintf");
+		request_lens[i] = len;
+	}
+}
+
+static void resolve_server(void)
+{
+	struct hostent *hent;
+
+	hent = gethostbyname(host);
+	DIE(hent == NULL, "gethostbyname");
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	memcpy(&server_addr.sin_addr.s_addr, hent->h_addr, sizeof(server_addr.sin_addr.s_addr));
+}
+
+static void report(void)
+{
+	struct histogram *total;
+	uint64_t requests = 0, bytes = 0, errors = 0, dropped = 0;
+	uint64_t status[6] = { 0 };
+	double secs = duration;
+	unsigned int i, j;
+
+	total = calloc(1, sizeof(*total));
+	DIE(total == NULL, "calloc");
+
+	for (i = 0; i < num_threads; i++) {
+		hist_merge(total, &threads[i].latency);
+		requests += threads[i].requests;
+		bytes += threads[i].bytes;
+		errors += threads[i].errors;
+		dropped += threads[i].dropped;
+		for (j = 0; j < 6; j++)
+			status[j] += threads[i].status[j];
+	}
+
+	printf("%u connections, %u threads, %s loop, %s, %.1f s\n",
+	       num_conns, num_threads, interval ? "open" : "closed",
+	       keep_alive ? "keep-alive" : "close", secs);
+	for (i = 0; i < num_paths; i++)
+		printf("  %s\n", paths[i]);
+	printf("requests:   %llu (%.0f req/s)\n", (unsigned long long)requests, requests / secs);
+	printf("throughput: %.2f MB/s\n", bytes / secs / 1e6);
+	printf("status:     2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, other %llu\n",
+	       (unsigned long long)status[2], (unsigned long long)status[3],
+	       (unsigned long long)status[4], (unsigned long long)status[5],
+	       (unsigned long long)(status[0] + status[1]));
+	printf("errors:     %llu\n", (unsigned long long)errors);
+	if (interval)
+		printf("dropped:    %llu\n", (unsigned long long)dropped);
+	printf("latency us: p50 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+	       (unsigned long long)hist_percentile(total, 50),
+	       (unsigned long long)hist_percentile(total, 99),
+	       (unsigned long long)hist_percentile(total, 99.9),
+	       (unsigned long long)total->max);
+
+	free(total);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-p port] [-c conns] [-t threads] [-d seconds]\n"
+		"          [-r rate] [-k] path...\n"
+		"  -c N  concurrent connections (default %u)\n"
+		"  -t N  client threads sharing the connections (default %u)\n"
+		"  -d S  duration of the run in seconds (default %.0f)\n"
+		"  -r R  open loop at R requests/s in total (default: closed loop)\n"
+		"  -k    keep connections alive (default: one connection per request)\n"
+		"Connections cycle through the paths given.\n",
+		argv0, num_conns, num_threads, duration);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_thread *t;
+	unsigned int i, j, first;
+	uint64_t stagger;
+	int opt;
+	int rc;
+
+	while ((opt = getopt(argc, argv, "h:p:c:t:d:r:k")) != -1) {
+		switch (opt) {
+		case 'h':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			num_conns = atoi(optarg);
+			break;
+		case 't':
+			num_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'k':
+			keep_alive = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	for (; optind < argc && num_paths < BENCH_MAX_PATHS; optind++)
+		paths[num_paths++] = argv[optind];
+	if (num_paths == 0 || num_conns == 0 || duration <= 0 || rate < 0)
+		usage(argv[0]);
+	if (num_threads == 0 || num_threads > BENCH_MAX_THREADS)
+		num_threads = 1;
+	if (num_threads > num_conns)
+		num_threads = num_conns;
+
+	format_requests();
+	resolve_server();
+
+	/* Each connection carries an equal share of the open loop rate. */
+	if (rate > 0)
+		interval = (uint64_t)(1e9 * num_conns / rate);
+
+	start_time = now_ns();
+	end_time = start_time + (uint64_t)(duration * 1e9);
+	stagger = interval / num_conns;
+
+	first = 0;
+	for (i = 0; i < num_threads; i++) {
+		t = &threads[i];
+		t->nconns = num_conns / num_threads + (i < num_conns % num_threads);
+		t->conns = calloc(t->nconns, sizeof(*t->conns));
+		DIE(t->conns == NULL, "calloc");
+		t->epollfd = w_epoll_create();
+		DIE(t->epollfd < 0, "w_epoll_create");
+
+		for (j = 0; j < t->nconns; j++) {
+			t->conns[j].fd = -1;
+			t->conns[j].state = BENCH_IDLE;
+			t->conns[j].path = (first + j) % num_paths;
+			/* spread the open loop requests evenly over an interval */
+			t->conns[j].next_due = start_time + (first + j) * stagger;
+			if (keep_alive)
+				bench_connect(t, &t->conns[j]);
+		}
+		first += t->nconns;
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		rc = pthread_create(&threads[i].thread, NULL, bench_thread_loop, &threads[i]);
+		DIE(rc != 0, "pthread_create");
+	}
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	report();
+
+	return 0;
+}
@@ -0,0 +1,45 @@
+#!/bin/bash
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Benchmark a running server: create static and dynamic files of the given
+# sizes below its document root, then load each one with and without
+# keep-alive.
+#
+# Usage: run_bench.sh [-r docroot] [-s "sizes"] [-- aws_bench options]
+#        (defaults: the tests directory, sizes "1K 16K 1M")
+
+cd "$(dirname "$0")" || exit 1
+
+DOCROOT=..
+SIZES="1K 16K 1M"
+
+while getopts "r:s:" opt; do
+    case "$opt" in
+        r) DOCROOT="$OPTARG" ;;
+        s) SIZES="$OPTARG" ;;
+        *) echo "Usage: $0 [-r docroot] [-s sizes] [-- aws_bench options]" 1>&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+make -s || exit 1
+
+mkdir -p "$DOCROOT/static" "$DOCROOT/dynamic"
+for size in $SIZES; do
+    name="bench-$size.dat"
+    if [ ! -f "$DOCROOT/static/$name" ]; then
+        head -c "$(numfmt --from=iec "$size")" /dev/urandom > "$DOCROOT/static/$name"
+    fi
+    cp -p "$DOCROOT/static/$name" "$DOCROOT/dynamic/$name"
+done
+
+for size in $SIZES; do
+    for kind in static dynamic; do
+        for ka in -k ""; do
+            echo "=== $kind $size ${ka:+keep-alive}"
+            # shellcheck disable=SC2086
+            ./aws_bench $ka "$@" "/$kind/bench-$size.dat"
+            echo
+        done
+    done
+done
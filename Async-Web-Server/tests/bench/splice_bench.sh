@@ -0,0 +1,54 @@
+#!/bin/bash
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Compare the two ways of sending dynamic files: start the server once with
+# AIO buffers and once with splice(2), and load the same large dynamic files
+# over keep-alive connections each time. The server must not be running.
+#
+# Usage: splice_bench.sh [-r docroot] [-s "sizes"] [-- aws_bench options]
+#        (defaults: the tests directory, sizes "1M 16M")
+
+cd "$(dirname "$0")" || exit 1
+
+DOCROOT=..
+SIZES="1M 16M"
+AWS="$(readlink -f "${SRC_PATH:-../../src}")/aws"
+
+while getopts "r:s:" opt; do
+    case "$opt" in
+        r) DOCROOT="$OPTARG" ;;
+        s) SIZES="$OPTARG" ;;
+        *) echo "Usage: $0 [-r docroot] [-s sizes] [-- aws_bench options]" 1>&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+make -s || exit 1
+if [ ! -x "$AWS" ]; then
+    echo "Cannot find $AWS" 1>&2
+    exit 1
+fi
+
+mkdir -p "$DOCROOT/static" "$DOCROOT/dynamic"
+for size in $SIZES; do
+    name="bench-$size.dat"
+    if [ ! -f "$DOCROOT/static/$name" ]; then
+        head -c "$(numfmt --from=iec "$size")" /dev/urandom > "$DOCROOT/static/$name"
+    fi
+    cp -p "$DOCROOT/static/$name" "$DOCROOT/dynamic/$name"
+done
+
+for mode in aio splice; do
+    (cd "$DOCROOT" && exec "$AWS" -d "$mode" 2> /dev/null) &
+    aws_pid=$!
+    sleep 1
+
+    for size in $SIZES; do
+        echo "=== dynamic $size $mode"
+        ./aws_bench -k "$@" "/dynamic/bench-$size.dat"
+        echo
+    done
+
+    kill "$aws_pid"
+    wait "$aws_pid" 2> /dev/null
+done
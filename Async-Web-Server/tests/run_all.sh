@@ -2,7 +2,7 @@
 # SPDX-License-Identifier: BSD-3-Clause
 
 first_test=1
-last_test=35
+last_test=49
 script=run_test.sh
 timeout=30
 log_file=test.log
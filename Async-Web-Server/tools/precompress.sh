@@ -0,0 +1,59 @@
+#!/bin/bash
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Write gzip and zstd variants next to the files of a document tree, for
+# aws to send to clients that accept them. Variants are only written when
+# they save space, and are refreshed when older than their file; aws
+# ignores a variant older than the file it stands for.
+#
+# Usage: precompress.sh [-l level] [-m min_bytes] [dir...]
+#        (default: ./static)
+
+LEVEL=9
+MIN_SIZE=256
+
+usage() {
+    echo "Usage: $0 [-l level] [-m min_bytes] [dir...]" 1>&2
+    exit 1
+}
+
+while getopts "l:m:" opt; do
+    case "$opt" in
+        l) LEVEL="$OPTARG" ;;
+        m) MIN_SIZE="$OPTARG" ;;
+        *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+[ $# -eq 0 ] && set -- ./static
+
+HAVE_ZSTD=0
+command -v zstd >/dev/null 2>&1 && HAVE_ZSTD=1
+command -v gzip >/dev/null 2>&1 || { echo "gzip not found" 1>&2; exit 1; }
+
+# compress FILE SUFFIX COMMAND...: write FILE.SUFFIX unless up to date
+compress() {
+    local file="$1" suffix="$2"
+    local out="$file$suffix" tmp="$file$suffix.tmp"
+    shift 2
+
+    [ -e "$out" ] && ! [ "$file" -nt "$out" ] && return 0
+
+    "$@" < "$file" > "$tmp" || { rm -f "$tmp"; return 1; }
+
+    # Keep the variant only if it is smaller than the file.
+    if [ "$(stat -c %s "$tmp")" -lt "$(stat -c %s "$file")" ]; then
+        touch -r "$file" "$tmp"
+        mv -f "$tmp" "$out"
+        echo "$out"
+    else
+        rm -f "$tmp" "$out"
+    fi
+}
+
+find "$@" -type f ! -name '*.gz' ! -name '*.zst' ! -name '*.tmp' -size +"$((MIN_SIZE - 1))"c -print0 |
+while IFS= read -r -d '' file; do
+    compress "$file" .gz gzip -n -c -"$LEVEL"
+    [ "$HAVE_ZSTD" -eq 1 ] && compress "$file" .zst zstd -q -c -"$LEVEL"
+done